@@ -73,14 +73,18 @@ public:
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
-
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    // The optimizer tunes code for the host CPU, see
+    // initialize_modules_and_managers_for_jit(); codegen has to use the same
+    // features, e.g. for the vector math library variants it calls.
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
+
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*JTMB),
                                              std::move(*DL));
   }
 
@@ -97,6 +101,11 @@ public:
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  Error defineAbsolute(StringRef Name, ExecutorSymbolDef Sym,
+                       ResourceTrackerSP RT = nullptr) {
+    return MainJD.define(absoluteSymbols({{Mangle(Name.str()), Sym}}), RT);
+  }
 };
 
 } // end namespace orc
@@ -10,8 +10,11 @@
 #include "llvm/IR/Value.h"
 #include "llvm/Passes/StandardInstrumentations.h"
 #include "llvm/Support/Casting.h" // important for llvm-style RTTI
+#include <limits>
 #include <map>
 #include <memory>
+#include <optional>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -29,13 +32,18 @@ public:
     CallExpr,
     IfExpr,
     ForExpr,
-    WithExpr
+    WithExpr,
+    IndexExpr
   };
 
 private:
   const ExprKind Kind;
   SourceLocation location;
 
+protected:
+  // The value of the node is what the enclosing function returns.
+  bool TailPosition = false;
+
 public:
   ExprKind getKind() const { return Kind; }
 
@@ -44,6 +52,30 @@ public:
 
   virtual ~ExprAST();
   virtual Value *codegen() = 0;
+  // Tree-walking evaluation for cheap top-level expressions (interpreter.cpp)
+  virtual std::optional<double> interpret() = 0;
+  // Rough cost of interpreting the node, capped at INTERPRET_COST_LIMIT + 1
+  // which means "compile it instead".
+  virtual unsigned interpret_cost() const = 0;
+  // Called before codegen on the body of a function, and passed down to the
+  // nodes whose value becomes the value of their parent.
+  virtual void mark_tail_position() { TailPosition = true; }
+
+  // Type inference (types.cpp), valid during codegen: the largest magnitude
+  // of the value if it is always an integer and every value up to that bound
+  // is exact in the number type, so it can be computed in i64 with the same
+  // result. Loop variables that are never assigned and are bounded by such
+  // values are integers too.
+  virtual std::optional<double> get_integer_bound() const {
+    return std::nullopt;
+  }
+  bool is_integer() const { return get_integer_bound().has_value(); }
+  // Whether the node may assign to a variable called `name`.
+  virtual bool assigns(const std::string &name) const = 0;
+  // The value as an i64, for nodes whose is_integer() holds.
+  virtual Value *codegen_integer();
+  // The truth of the value as an i1, for `if` and `for` conditions.
+  virtual Value *codegen_condition();
 
   int get_line() const { return location.line; }
   int get_col() const { return location.col; }
@@ -55,6 +87,12 @@ class NumberExprAST : public ExprAST {
 public:
   NumberExprAST(double Val);
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  std::optional<double> get_integer_bound() const override;
+  bool assigns(const std::string &name) const override;
+  Value *codegen_integer() override;
+  double get_value() const { return Val; }
   static bool classof(const ExprAST *E) { return E->getKind() == NumberExpr; }
 };
 
@@ -64,6 +102,11 @@ class VariableExprAST : public ExprAST {
 public:
   VariableExprAST(const std::string &Name);
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  std::optional<double> get_integer_bound() const override;
+  bool assigns(const std::string &name) const override;
+  Value *codegen_integer() override;
   const std::string &get_name() const { return Name; }
   static bool classof(const ExprAST *E) { return E->getKind() == VariableExpr; }
 };
@@ -76,6 +119,15 @@ public:
   BinaryExprAST(SourceLocation binop_loc, std::string Op,
                 std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS);
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  std::optional<double> get_integer_bound() const override;
+  bool assigns(const std::string &name) const override;
+  Value *codegen_integer() override;
+  Value *codegen_condition() override;
+  const std::string &get_op() const { return Op; }
+  ExprAST *get_lhs() const { return LHS.get(); }
+  ExprAST *get_rhs() const { return RHS.get(); }
   static bool classof(const ExprAST *E) { return E->getKind() == BinaryExpr; }
 };
 
@@ -86,6 +138,9 @@ class UnaryExprAST : public ExprAST {
 public:
   UnaryExprAST(std::string Op, std::unique_ptr<ExprAST> Operand);
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  bool assigns(const std::string &name) const override;
   static bool classof(const ExprAST *E) { return E->getKind() == UnaryExpr; }
 };
 
@@ -97,7 +152,30 @@ public:
   CallExprAST(SourceLocation FnNameLoc, const std::string &Callee,
               std::vector<std::unique_ptr<ExprAST>> Args);
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  bool assigns(const std::string &name) const override;
   static bool classof(const ExprAST *E) { return E->getKind() == CallExpr; }
+
+private:
+  Value *codegen_array_builtin();
+};
+
+// a[i]: an element of an array. Arrays are numbers too, handles of storage
+// the runtime allocates (see external.h).
+class IndexExprAST : public ExprAST {
+  std::unique_ptr<ExprAST> Array, Index;
+
+public:
+  IndexExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Array,
+               std::unique_ptr<ExprAST> Index);
+  Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  bool assigns(const std::string &name) const override;
+  // The address of the element, after the bounds check
+  Value *codegen_address();
+  static bool classof(const ExprAST *E) { return E->getKind() == IndexExpr; }
 };
 
 class PrototypeAST {
@@ -106,11 +184,16 @@ class PrototypeAST {
   bool IsOperator;
   unsigned Precedence;
   unsigned LocationLine;
+  bool IsPure; // extern pure: defined elsewhere without side effects
 
 public:
   PrototypeAST(SourceLocation DefLoc, const std::string &Name, std::vector<std::string> Args,
-               bool IsOperator = false, unsigned Prec = 0);
+               bool IsOperator = false, unsigned Prec = 0, bool IsPure = false);
   int get_arg_size() const { return Args.size(); }
+  const std::vector<std::string> &get_args() const { return Args; }
+  bool is_operator() const { return IsOperator; }
+  bool is_pure() const { return IsPure; }
+  void mark_pure() { IsPure = true; }
   const std::string &get_name() const;
   const std::string get_operator_name() const;
   bool is_unary_op() const;
@@ -124,12 +207,15 @@ public:
 class FunctionAST {
   std::unique_ptr<PrototypeAST> Proto;
   std::unique_ptr<ExprAST> Body;
+  bool IsMemo; // memo def: results are cached by the runtime
 
 public:
   FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExprAST> Body);
+              std::unique_ptr<ExprAST> Body, bool IsMemo = false);
   const std::string &get_name() const;
   Function *codegen();
+  std::optional<double> interpret();
+  unsigned interpret_cost() const;
 };
 
 class IfExprAST : public ExprAST {
@@ -140,18 +226,77 @@ public:
             std::unique_ptr<ExprAST> Else);
 
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  bool assigns(const std::string &name) const override;
+  void mark_tail_position() override;
   static bool classof(const ExprAST *E) { return E->getKind() == IfExpr; }
 };
 
+// One hint of `for[unroll=4, vectorize=8, interleave=2]`: unset (the cost
+// model decides), `enable`, `disable`, `full` (unroll only) or a count, i.e.
+// the unroll factor, the vector width or the interleave count, in Value.
+struct LoopHint {
+  enum HintKind { Unset, Enable, Disable, Full, Count } Kind = Unset;
+  unsigned Value = 0;
+};
+
+struct LoopHints {
+  LoopHint Unroll, Vectorize, Interleave;
+};
+
+// `reduce <op>` combines the values of a loop's body with `+`, `*`, `min` or
+// `max`. The operator counts as associative, so the values may be combined in
+// any order, e.g. one partial result per vector lane or per thread. The
+// numbering is shared with kl_parallel_reduce.
+enum class ReduceOp { None, Add, Mul, Min, Max };
+
+// The result of reducing no values
+inline double get_reduce_identity(ReduceOp op) {
+  switch (op) {
+  case ReduceOp::Mul:
+    return 1.0;
+  case ReduceOp::Min:
+    return std::numeric_limits<double>::infinity();
+  case ReduceOp::Max:
+    return -std::numeric_limits<double>::infinity();
+  default:
+    return 0.0;
+  }
+}
+
 class ForExprAST : public ExprAST {
   std::string VarName;
   std::unique_ptr<ExprAST> Start, Condition, Step, Body;
+  LoopHints Hints;
+  bool IsParallel; // parfor: iterations may run on several threads
+  ReduceOp Reduction;
+
+  Value *codegen_parallel();
+  Value *codegen_loop(std::optional<double> bound, Value *end);
+
+  // Integer counters (types.cpp)
+  ExprAST *get_counter_end() const;
+  std::optional<double> get_counter_bound() const;
+  // An end that is only known at runtime: the variable counts in i64 if its
+  // magnitude is at most Limit. Up when the variable counts up by Step,
+  // down otherwise.
+  struct CheckedEnd {
+    ExprAST *End;
+    double Limit, Step;
+    bool Up;
+  };
+  std::optional<CheckedEnd> get_checked_end() const;
 
 public:
   ForExprAST(std::string VariableName, std::unique_ptr<ExprAST> Start,
              std::unique_ptr<ExprAST> Condition, std::unique_ptr<ExprAST> Step,
-             std::unique_ptr<ExprAST> Body);
+             std::unique_ptr<ExprAST> Body, LoopHints Hints = {},
+             bool IsParallel = false, ReduceOp Reduction = ReduceOp::None);
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  bool assigns(const std::string &name) const override;
   static bool classof(const ExprAST *E) { return E->getKind() == ForExpr; }
 };
 
@@ -164,17 +309,34 @@ class WithExprAST : public ExprAST {
 public:
   WithExprAST(VariableVector Variables, std::unique_ptr<ExprAST> Body);
   Value *codegen() override;
+  std::optional<double> interpret() override;
+  unsigned interpret_cost() const override;
+  bool assigns(const std::string &name) const override;
+  void mark_tail_position() override;
   static bool classof(const ExprAST *E) { return E->getKind() == WithExpr; }
 };
 
 // central maps
 //
 extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-extern std::map<std::string, ResourceTrackerSP *> FunctionRTs;
+extern std::map<std::string, ResourceTrackerSP> FunctionRTs;
+extern std::map<std::string, double> Constants; // `const` definitions
+// Names the program defined itself. A definition of e.g. `min` takes
+// precedence over the math intrinsic.
+extern std::set<std::string> Definitions;
+
+// The declaration of function `name` in TheModule, created from its prototype
+// on first use (codegen.cpp).
+Function *get_function(const std::string &name);
+// Integer variables codegen created -> the bound of their values (types.cpp)
+extern std::map<const AllocaInst *, double> IntegerBounds;
 
 // Error handling
 
+extern unsigned ERROR_COUNT; // errors reported so far
+
 inline std::unique_ptr<ExprAST> log_error(const char *Str) {
+  ++ERROR_COUNT;
   fprintf(stderr, "\rError: %s\n", Str);
   return nullptr;
 }
@@ -184,8 +346,18 @@ inline std::unique_ptr<PrototypeAST> log_error_p(const char *Str) {
   return nullptr;
 }
 
+inline std::unique_ptr<FunctionAST> log_error_f(const char *Str) {
+  log_error(Str);
+  return nullptr;
+}
+
 inline Value *log_error_v(const char *Str) {
   log_error(Str);
   return nullptr;
 }
+
+inline std::optional<double> log_error_i(const char *Str) {
+  log_error(Str);
+  return std::nullopt;
+}
 #endif
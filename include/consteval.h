@@ -0,0 +1,25 @@
+#ifndef CONSTEVAL_H
+#define CONSTEVAL_H
+
+#include "internal.h"
+#include <optional>
+#include <vector>
+
+// Compile-time evaluation
+//
+// kppc runs calls to pure functions whose arguments are all constants, e.g. a
+// table size computed by `fact(20)`, and compiles the result instead of the
+// call. The IR is interpreted, within CONST_EVAL_STEP_LIMIT instructions and
+// CONST_EVAL_TIME_LIMIT_MS; code that does anything but arithmetic on its own
+// variables and calls to other such functions or to libm can not be
+// evaluated.
+
+// Runs F, whose callees must be defined in its module.
+std::optional<double> evaluate_call(const Function &F,
+                                    const std::vector<double> &args);
+
+// Replaces the calls in F to pure functions with constant arguments by their
+// results. Returns whether any call was replaced.
+bool fold_constant_calls(Function &F);
+
+#endif
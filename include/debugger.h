@@ -7,11 +7,11 @@
 
 struct DebugInfo {
   DICompileUnit *TheCU;
-  DIType *DblTy;
+  DIType *NumTy;
   DIType *IntTy;
   std::vector<DIScope *> LexicalBlocks;
 
-  DIType *get_double_type();
+  DIType *get_num_type();
   DIType *get_int_type();
   void emit_location(ExprAST *ast);
 };
@@ -26,6 +26,9 @@ class DebugInfoInserter {
 
 public:
   static void emit_location(ExprAST *ast);
+  // A variable of a `with`, in the current scope
+  static void insert_local_variable(ExprAST *ast, StringRef name,
+                                    AllocaInst *alloca);
 
   // General methods
   // Function methods
@@ -0,0 +1,60 @@
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+#include "internal.h"
+#include "llvm/IR/Intrinsics.h"
+#include <optional>
+#include <string>
+
+// What a function may do besides computing its result. Every Kl++ value is a
+// double and only a few externs have side effects, so most functions turn out
+// to be pure, which lets LLVM CSE, hoist and delete calls to them.
+struct FunctionEffects {
+  bool ReadNone = false;     // memory(none), see WritesCache
+  bool NoUnwind = false;     // nounwind
+  bool WillReturn = false;   // willreturn
+  bool Speculatable = false; // speculatable
+  // A memo function, or a caller of one, writes the memo cache, which Kl++
+  // code can not observe: it is still ReadNone, but gets
+  // memory(inaccessiblemem: readwrite), so LLVM keeps the calls.
+  bool WritesCache = false;
+
+  bool operator==(const FunctionEffects &) const = default;
+};
+
+// Whether `name` is one of the libm functions Kl++ knows.
+bool is_math_function(const std::string &name);
+
+// The intrinsic calls to the math function `name` with `arg_count` arguments
+// compile to: sqrt, fabs, floor, ceil, trunc, round, sin, cos, exp, exp2, log,
+// log2, log10, pow, fmin, fmax, min, max, copysign and fma.
+Intrinsic::ID get_math_intrinsic(const std::string &name, size_t arg_count);
+
+// Whether the result of a call to F depends on its arguments alone, with no
+// side effects besides memo caches, from its attributes.
+bool computes_from_arguments(const Function &F);
+
+// Effects of known externs, and of definitions inferred so far.
+std::optional<FunctionEffects> known_effects(const std::string &name);
+
+// `extern pure`: the definition of `name` has no side effects and returns.
+void declare_pure(const std::string &name);
+
+// Drops what is known about `name` when it is redefined.
+void forget_effects(const std::string &name);
+
+// Sets the attributes of a declaration from known_effects().
+void apply_known_effects(Function &F);
+
+// Effects of a definition, from its body and its callees' attributes.
+FunctionEffects analyze_effects(const Function &F);
+
+// Infers the effects of a definition from its body and its callees' attributes,
+// attaches them and remembers them for later declarations.
+void infer_effects(Function &F);
+
+// Same for every definition of a module, callees before callers, so mutually
+// recursive functions are handled together.
+void infer_effects(Module &M);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef EXTERNAL_H
+#define EXTERNAL_H
+
+#include <cstdint>
+
+// Arrays
+//
+// An array value is a handle, the index of the array's entry in kl_arrays,
+// a table of pages of entries: the high bits of the handle pick the page and
+// the low bits the entry. Pages are allocated as handles are handed out and
+// never move; the pages not in use yet all point to one empty page. Generated
+// code reads the data and the length from there, and allocates and frees
+// through kl_array_new and kl_array_free. Entry 0 is never used, so 0, freed
+// handles and, after clamping, out-of-range handles have length 0.
+#define KL_ARRAY_PAGE_BITS 12
+#define KL_ARRAY_PAGE_SIZE (1 << KL_ARRAY_PAGE_BITS)
+#define KL_ARRAY_PAGES (1 << 12)
+// 2^24, so that handles are exact in floats too
+#define KL_ARRAY_LIMIT (KL_ARRAY_PAGES * KL_ARRAY_PAGE_SIZE)
+// Storage is aligned to cache lines
+#define KL_ARRAY_ALIGNMENT 64
+
+struct KlArray {
+  void *Data;
+  int64_t Length;
+};
+
+// Runtime entry points (lib/external.cpp) used by the host itself rather than
+// by Kl++ code.
+extern "C" void kl_set_args(int argc, char **argv);
+// Writes out buffered output; the REPL calls it after every expression.
+extern "C" void kl_flush();
+// Frees the memo caches of the function `name`, whose code has been removed.
+extern "C" void kl_memo_release(const char *name);
+
+// The float variants of the runtime, which the REPL binds to the plain names
+// under `--precision=single`.
+extern "C" float kl_f32_putchard(float X);
+extern "C" float kl_f32_print(float X);
+extern "C" float kl_f32_printd(float X);
+extern "C" float kl_f32_flush();
+extern "C" float kl_f32_nargs();
+extern "C" float kl_f32_arg(float X);
+extern "C" float kl_f32_memostats();
+extern "C" float kl_f32_memolimit(float X);
+extern "C" float kl_f32_mapfile(float X);
+extern "C" float kl_f32_mapdata();
+extern "C" float kl_f32_readnum();
+extern "C" float kl_f32_eof();
+extern "C" int kl_f32_kl_memo_lookup(void **slot, const char *name,
+                                     const float *args, int n, float *result);
+extern "C" void kl_f32_kl_memo_store(void **slot, const float *args, int n,
+                                     float result);
+extern "C" float kl_f32_kl_parallel_reduce(float (*body)(void *, int64_t,
+                                                         int64_t),
+                                           void *env, int64_t n, int op);
+
+#endif
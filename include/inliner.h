@@ -0,0 +1,43 @@
+#ifndef INLINER_H
+#define INLINER_H
+
+#include "internal.h"
+#include <string>
+#include <vector>
+
+// Every REPL definition is compiled in its own module, so the optimizer never
+// sees the bodies of earlier definitions. The JIT keeps a copy of each
+// definition's IR and imports small callees into the caller's module before
+// it is optimized.
+
+// IR straight from codegen, used to rebuild the function when a callee it
+// inlined is redefined.
+void keep_pristine_copy(const Function &F);
+// Optimized IR that later callers may inline.
+void keep_optimized_copy(const Function &F);
+
+// Imports and inlines every small callee of F that has an optimized copy.
+void inline_small_callees(Function &F);
+
+// Stops inlining `name`, e.g. once its definition has been removed.
+void forget_inlined_body(const std::string &name);
+
+// Drops both copies of `name`, so it is not rebuilt either.
+void forget_function(const std::string &name);
+
+// The pristine copy of `name`, if there is one.
+const Function *pristine_copy(const std::string &name);
+
+// Records that F relies on the current definition of `callee`, so F is
+// rebuilt when `callee` is redefined.
+void depend_on(const Function &F, const std::string &callee);
+
+// Returns every function that inlined `name` or relied on its effects,
+// directly or through another such function, callees before callers.
+std::vector<std::string> stale_inliners(const std::string &name);
+
+// Regenerates `name` in TheModule from its pristine copy, inlining the
+// current definitions of its callees.
+Function *rebuild_function(const std::string &name);
+
+#endif
@@ -4,6 +4,7 @@
 #include "Kaleidoscope.h"
 #include "lex.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -16,17 +17,50 @@
 #define REPL_STR ">> "
 #define UNIT_TERMINATOR -128
 
+// Top-level expressions cheaper than this are interpreted instead of compiled
+#define INTERPRET_COST_LIMIT 64
+#define INTERPRET_CALL_COST 4
+#define INTERPRET_MAX_ARGS 6
+
+// Definitions with at most this many instructions after optimization are
+// inlined into later units by the JIT
+#define INLINE_SIZE_LIMIT 40
+
+// Callees with at most this many instructions are specialized for constant
+// arguments, with at most this many specializations each
+#define SPECIALIZE_SIZE_LIMIT 400
+#define SPECIALIZE_MAX_VARIANTS 8
+
+// Limits of compile-time evaluation (consteval.cpp)
+#define CONST_EVAL_STEP_LIMIT 50000000
+#define CONST_EVAL_TIME_LIMIT_MS 2000
+#define CONST_EVAL_MAX_DEPTH 1000
+
+// Largest unroll factor, vector width or interleave count of a loop hint
+#define LOOP_HINT_MAX_COUNT 1024
+
 using namespace llvm;
 using namespace llvm::orc;
 
 extern bool DEBUG;
+extern bool PRINT_PASSES;
+extern bool BATCH_MODE; // kpp --run: the whole program goes into TheModule
+extern bool TIERED;     // kpp --tiered: recompile hot functions at O3
+extern bool JIT_INLINING; // inline small definitions across REPL units
+extern bool CONST_EVAL;   // kppc: evaluate pure calls with constant arguments
+extern bool SIMD_VARIANTS; // kppc: vector variants of pure functions
+extern FastMathFlags FAST_MATH; // -ffast-math and the finer options
+extern bool SINGLE_PRECISION;   // --precision=single: numbers are floats
+extern bool BOUNDS_CHECK;       // a[i] checks i; off with -fno-bounds-check
 
-extern std::unique_ptr<LLVMContext> TheContext;
+extern ThreadSafeContext TheTSC;
+extern LLVMContext *TheContext;
 extern std::unique_ptr<IRBuilder<>> Builder;
 extern std::unique_ptr<Module> TheModule;
 extern std::map<std::string, AllocaInst *> NamedValues;
 extern std::unique_ptr<KaleidoscopeJIT> TheJIT;
 extern std::unique_ptr<FunctionPassManager> TheFPM;
+extern std::unique_ptr<FunctionPassManager> TheTier0FPM;
 extern std::unique_ptr<LoopAnalysisManager> TheLAM;
 extern std::unique_ptr<FunctionAnalysisManager> TheFAM;
 extern std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
@@ -40,8 +74,32 @@ extern std::unique_ptr<DIBuilder> DBuilder;
 
 extern std::map<std::string, int> BINOP_PRECEDENCE;
 
-AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name);
+// The type of every Kl++ number: double, or float with --precision=single.
+inline Type *get_num_type() {
+  return SINGLE_PRECISION ? Type::getFloatTy(*TheContext)
+                          : Type::getDoubleTy(*TheContext);
+}
+inline Constant *get_num(double value) {
+  return ConstantFP::get(get_num_type(), value);
+}
+
+// A variable of `type`, a number by default
+AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name,
+                                      Type *type = nullptr);
 void initialize_modules_and_managers_for_jit();
+void initialize_module_for_jit();
+void optimize_function(Function &F);
+// Copies `src` into `dst`; the functions and external globals it references
+// become declarations of `dst`. `define_globals` defines the globals instead,
+// for a copy that replaces the original or keeps it for later.
+Function *copy_function_into(const Function &src, Module &dst,
+                             bool define_globals = false);
+void optimize_module();
+// Parses the options kpp and kppc share: --precision=single|double,
+// -ffast-math, -ffp-contract=fast|off, -fassociative-math, -fno-honor-nans,
+// -fno-honor-infinities, -fno-bounds-check and -fveclib=<library>. Returns
+// false for any other option.
+bool parse_codegen_option(const char *option);
 
 inline void set_lex_source(std::unique_ptr<std::istream> source_stream) {
   reset_lex_loc();
@@ -44,7 +44,7 @@ enum Token {
   tok_else = -8,
 
   // for
-  // for var = start, condition, step do top_level_expression end;
+  // for[hints] var = start, condition, step do top_level_expression end;
   tok_for = -9,
   tok_do = -10,
   tok_end = -11,
@@ -55,7 +55,23 @@ enum Token {
   tok_operator = -14,
 
   // var
-  tok_with = -15
+  tok_with = -15,
+
+  // memo def
+  tok_memo = -16,
+
+  // const name = expression
+  tok_const = -17,
+
+  // extern pure prototype
+  tok_pure = -18,
+
+  // parfor: a for whose iterations may run in parallel
+  tok_parfor = -19,
+
+  // reduce op for ...: combines the values of the body; parreduce in parallel
+  tok_reduce = -20,
+  tok_parreduce = -21
 };
 
 void reset_lex_loc();
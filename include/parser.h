@@ -1,9 +1,19 @@
 #ifndef PARSER_H
 #define PARSER_H
 #include "lex.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/IR/Function.h"
+#include <string>
 
 extern int cur_tok;
 inline int get_next_token() { return cur_tok = gettok(); }
 void handle_definition(), handle_extern(), handle_top_level_expression();
+void handle_const();
+void wait_for_pending_units();
+
+// Like handle_definition(), for a definition that `generate` emits into
+// TheModule without going through the parser, e.g. from a precompiled prelude.
+void handle_loaded_definition(const std::string &name,
+                              llvm::function_ref<llvm::Function *()> generate);
 
 #endif
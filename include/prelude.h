@@ -0,0 +1,25 @@
+#ifndef PRELUDE_H
+#define PRELUDE_H
+
+#include <string>
+
+// Precompiled preludes
+//
+// Headers and libraries that are loaded before user code (lib/core.hkl, the
+// standard library, `kpp --prelude` files) are cached next to the source as
+// `<file>.kpch`: the prototypes it declares, with the precedences of its
+// operators, the values of its constants and the bitcode of its definitions.
+// The cache is mapped and loaded in one step, and rebuilt from the text
+// whenever the source changes. `--precision=single` uses `<file>.f32.kpch`.
+//
+// Preludes may only contain definitions, constants and `extern` declarations.
+
+#define KPCH_SUFFIX ".kpch"
+#define KPCH_MAGIC "KPCH"
+#define KPCH_VERSION 4
+
+// Loads `path` through its precompiled form. `handle_unit` parses the text of
+// the current lexer source when the cache has to be rebuilt.
+bool load_prelude(const std::string &path, void (*handle_unit)());
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "internal.h"
+
+// SIMD variants
+//
+// A loop that calls a Kl++ function can only be vectorized if the callee has
+// a vector variant. kppc compiles one for 2, 4 and 8 lanes of every pure
+// definition with arguments, as `<name>.simd<lanes>`, and advertises them
+// through the vector function ABI (the "vector-function-abi-variant"
+// attribute), so the loop vectorizer calls them instead of the scalar
+// function. A variant runs the inlined scalar body once per lane, which the
+// SLP vectorizer then packs. Only straight-line bodies, which call nothing but
+// vectorizable intrinsics, are advertised; the lanes of anything else would
+// run one after the other.
+//
+// Other translation units reach the variants through `extern pure`
+// declarations.
+
+// Adds the variants of the pure definition F; does nothing for other
+// functions.
+void add_simd_variants(Function &F);
+
+// Declares the variants of F, which is defined elsewhere and declared pure.
+void declare_simd_variants(Function &F);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef SPECIALIZER_H
+#define SPECIALIZER_H
+
+#include "internal.h"
+#include <string>
+#include <vector>
+
+// Calls with constant arguments, such as `christmastree(20, 20)`, are
+// redirected to a copy of the callee with the constants substituted for its
+// parameters, so the optimizer can fold them and fully unroll the loops they
+// bound.
+
+// JIT: specializations for the calls of F are compiled on demand, each in its
+// own module, and cached by callee and constant arguments.
+void specialize_constant_calls(Function &F);
+
+// Same within a module that is compiled as a whole. Returns the
+// specializations, which still have to be optimized.
+std::vector<Function *> specialize_constant_calls(Module &M);
+
+// Drops the cached specializations of `name` and returns their names.
+std::vector<std::string> forget_specializations(const std::string &name);
+
+#endif
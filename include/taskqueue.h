@@ -0,0 +1,37 @@
+#ifndef TASKQUEUE_H
+#define TASKQUEUE_H
+
+#include "llvm/Support/thread.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+// Stack size of worker threads; deep recursion in JIT'd code should not fail
+// earlier than on the main thread.
+#define TASK_STACK_SIZE (8 << 20)
+
+// Runs tasks one after another on a worker thread, in the order in which they
+// were pushed. The thread is started with the first task.
+class TaskQueue {
+  std::deque<std::function<void()>> Tasks;
+  std::mutex Mutex;
+  std::condition_variable Cond;
+  std::optional<llvm::thread> Worker;
+  std::thread::id WorkerId;
+  bool Busy = false;
+  bool Stopping = false;
+
+  void run();
+
+public:
+  ~TaskQueue();
+
+  void push(std::function<void()> task);
+  // Blocks until every task pushed so far has finished.
+  void wait();
+};
+
+#endif
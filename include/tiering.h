@@ -0,0 +1,30 @@
+#ifndef TIERING_H
+#define TIERING_H
+
+#include "internal.h"
+#include <cstdint>
+#include <string>
+
+// kpp --tiered
+//
+// Definitions are first compiled with TheTier0FPM and instrumented with entry
+// and back-edge counters. Every call goes through an indirection stub, so
+// when a counter reaches its threshold the function is recompiled at O3 on a
+// background thread and swapped in behind the stub.
+
+// Counts that make a function hot; at least 1, as the counters are compared
+// with the threshold after they are incremented.
+extern uint64_t TIER_ENTRY_THRESHOLD;
+extern uint64_t TIER_BACKEDGE_THRESHOLD;
+
+// Hands function `name` of the current module over to the JIT at tier 0 and
+// returns the tracker that owns its code.
+ResourceTrackerSP add_tiered_function(const std::string &name);
+
+// Declares the `tiers()` builtin that lists every function with its tier and
+// counters.
+void declare_tier_builtins();
+
+void wait_for_tier_ups();
+
+#endif
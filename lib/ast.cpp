@@ -2,7 +2,10 @@
 #include "lex.h"
 
 std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-std::map<std::string, ResourceTrackerSP *> FunctionRTs;
+std::map<std::string, ResourceTrackerSP> FunctionRTs;
+std::map<std::string, double> Constants;
+std::set<std::string> Definitions;
+unsigned ERROR_COUNT = 0;
 
 ExprAST::~ExprAST() = default;
 NumberExprAST::NumberExprAST(double Val) : ExprAST(NumberExpr), Val(Val) {}
@@ -22,9 +25,9 @@ UnaryExprAST::UnaryExprAST(std::string Op, std::unique_ptr<ExprAST> Operand)
 // PrototypeAST
 PrototypeAST::PrototypeAST(SourceLocation DefLoc, const std::string &Name,
                            std::vector<std::string> Args, bool IsOperator,
-                           unsigned Prec)
+                           unsigned Prec, bool IsPure)
     : Name(Name), Args(Args), IsOperator(IsOperator), Precedence(Prec),
-      LocationLine(DefLoc.line) {}
+      LocationLine(DefLoc.line), IsPure(IsPure) {}
 
 const std::string &PrototypeAST::get_name() const { return Name; }
 bool PrototypeAST::is_unary_op() const {
@@ -46,9 +49,13 @@ const std::string PrototypeAST::get_operator_name() const {
 CallExprAST::CallExprAST(SourceLocation FnNameLoc, const std::string &Callee,
                          std::vector<std::unique_ptr<ExprAST>> Args)
     : ExprAST(CallExpr, FnNameLoc), Callee(Callee), Args(std::move(Args)) {}
+IndexExprAST::IndexExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Array,
+                           std::unique_ptr<ExprAST> Index)
+    : ExprAST(IndexExpr, Loc), Array(std::move(Array)),
+      Index(std::move(Index)) {}
 FunctionAST::FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                         std::unique_ptr<ExprAST> Body)
-    : Proto(std::move(Proto)), Body(std::move(Body)) {};
+                         std::unique_ptr<ExprAST> Body, bool IsMemo)
+    : Proto(std::move(Proto)), Body(std::move(Body)), IsMemo(IsMemo) {};
 
 const std::string &FunctionAST::get_name() const { return Proto->get_name(); }
 
@@ -58,13 +65,26 @@ IfExprAST::IfExprAST(std::unique_ptr<ExprAST> Condition,
     : ExprAST(CallExpr), Condition(std::move(Condition)), Then(std::move(Then)),
       Else(std::move(Else)) {}
 
+void IfExprAST::mark_tail_position() {
+  TailPosition = true;
+  Then->mark_tail_position();
+  Else->mark_tail_position();
+}
+
 ForExprAST::ForExprAST(std::string VariableName, std::unique_ptr<ExprAST> Start,
                        std::unique_ptr<ExprAST> Condition,
                        std::unique_ptr<ExprAST> Step,
-                       std::unique_ptr<ExprAST> Body)
+                       std::unique_ptr<ExprAST> Body, LoopHints Hints,
+                       bool IsParallel, ReduceOp Reduction)
     : ExprAST(ForExpr), VarName(VariableName), Start(std::move(Start)),
       Condition(std::move(Condition)), Step(std::move(Step)),
-      Body(std::move(Body)) {}
+      Body(std::move(Body)), Hints(Hints), IsParallel(IsParallel),
+      Reduction(Reduction) {}
+
+void WithExprAST::mark_tail_position() {
+  TailPosition = true;
+  Body->mark_tail_position();
+}
 
 WithExprAST::WithExprAST(VariableVector Variables,
                          std::unique_ptr<ExprAST> Body)
@@ -1,23 +1,36 @@
 #include "ast.h"
 #include "debugger.h"
+#include "effects.h"
+#include "external.h"
 #include "internal.h"
+#include "simd.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Support/Casting.h"
-#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <format>
 #include <memory>
+#include <set>
+
+// The symbol a function is linked against. Single-precision code calls the
+// float variants of libm, e.g. `sinf` for `sin`.
+static std::string symbol_name(const std::string &name) {
+  if (SINGLE_PRECISION && is_math_function(name))
+    return name + "f";
+  return name;
+}
 
 Function *get_function(const std::string &name) {
-  if (auto *f = TheModule->getFunction(name))
+  if (auto *f = TheModule->getFunction(symbol_name(name)))
     return f;
 
   auto f = FunctionProtos.find(name);
@@ -27,28 +40,241 @@ Function *get_function(const std::string &name) {
   return nullptr;
 }
 
+// A call whose value the caller returns does not need the caller's frame any
+// more. When both have the same prototype, reusing the frame is guaranteed
+// (musttail), so tail-recursive code never grows the stack.
+static Value *create_call(Function *callee, ArrayRef<Value *> args,
+                          bool tail_position, const Twine &name) {
+  auto *call = Builder->CreateCall(callee, args, name);
+  auto *caller = Builder->GetInsertBlock()->getParent();
+  if (tail_position)
+    call->setTailCallKind(callee->getFunctionType() == caller->getFunctionType()
+                              ? CallInst::TCK_MustTail
+                              : CallInst::TCK_Tail);
+  return call;
+}
+
+// Returns from the function, unless a nested `if` in tail position already
+// did on every path.
+static void create_tail_return(Value *value) {
+  if (!Builder->GetInsertBlock()->getTerminator())
+    Builder->CreateRet(value);
+}
+
+// Only called where is_integer() holds, so the conversion is exact.
+Value *ExprAST::codegen_integer() {
+  auto *value = codegen();
+  if (!value)
+    return nullptr;
+  return Builder->CreateFPToSI(value, Builder->getInt64Ty(), "inttmp");
+}
+
+Value *ExprAST::codegen_condition() {
+  auto *value = codegen();
+  if (!value)
+    return nullptr;
+  return Builder->CreateFCmpONE(value, get_num(0.0), "cond");
+}
+
 Value *NumberExprAST::codegen() {
-  return ConstantFP::get(*TheContext, APFloat(Val));
+  return get_num(Val);
+}
+
+Value *NumberExprAST::codegen_integer() {
+  return Builder->getInt64(static_cast<int64_t>(Val));
 }
 
 Value *VariableExprAST::codegen() {
   AllocaInst *A = NamedValues[Name];
-  if (!A)
+  if (!A) {
+    if (auto constant = Constants.find(Name); constant != Constants.end())
+      return get_num(constant->second);
     return log_error_v("Unknown variable name");
+  }
+
+  if (is_integer())
+    return Builder->CreateSIToFP(codegen_integer(), get_num_type(),
+                                 Name.c_str());
+  return Builder->CreateLoad(get_num_type(), A, Name.c_str());
+}
+
+Value *VariableExprAST::codegen_integer() {
+  if (!NamedValues[Name])
+    return Builder->getInt64(static_cast<int64_t>(Constants[Name]));
+  return Builder->CreateLoad(Builder->getInt64Ty(), NamedValues[Name],
+                             Name.c_str());
+}
+
+// Arrays
+//
+// Type-based alias information: stores to elements never change the runtime's
+// table of arrays, so loops keep the page, data and length of an array in
+// registers.
+static MDNode *get_tbaa_tag(StringRef type_name) {
+  MDBuilder builder(*TheContext);
+  auto *root = builder.createTBAARoot("Kl++ TBAA");
+  auto *type = builder.createTBAAScalarTypeNode(type_name, root);
+  return builder.createTBAAStructTagNode(type, type, 0);
+}
+
+static StructType *get_array_entry_type() {
+  return StructType::get(Builder->getPtrTy(), Builder->getInt64Ty());
+}
+
+// kl_arrays, the runtime's table of pages of arrays
+static GlobalVariable *get_array_table() {
+  if (auto *table = TheModule->getGlobalVariable("kl_arrays"))
+    return table;
+  return new GlobalVariable(
+      *TheModule, ArrayType::get(Builder->getPtrTy(), KL_ARRAY_PAGES), false,
+      GlobalValue::ExternalLinkage, nullptr, "kl_arrays");
+}
 
-  return Builder->CreateLoad(Type::getDoubleTy(*TheContext), A, Name.c_str());
+// The handle in a number, or the index of an element
+static Value *create_array_index(Value *value, const Twine &name) {
+  return Builder->CreateFreeze(
+      Builder->CreateFPToSI(value, Builder->getInt64Ty()), name);
+}
+
+// The table entry of the array `handle`. With bounds checks, handles outside
+// of the table get the empty entry 0.
+static Value *create_array_entry(Value *handle) {
+  auto *index = create_array_index(handle, "handle");
+  if (BOUNDS_CHECK)
+    index = Builder->CreateSelect(
+        Builder->CreateICmpULT(index, Builder->getInt64(KL_ARRAY_LIMIT)),
+        index, Builder->getInt64(0));
+  auto *table = get_array_table();
+  auto *page_address = Builder->CreateInBoundsGEP(
+      table->getValueType(), table,
+      {Builder->getInt64(0),
+       Builder->CreateLShr(index, KL_ARRAY_PAGE_BITS, "page-index")});
+  auto *page =
+      Builder->CreateLoad(Builder->getPtrTy(), page_address, "page");
+  page->setMetadata(LLVMContext::MD_tbaa, get_tbaa_tag("array page"));
+  return Builder->CreateInBoundsGEP(
+      get_array_entry_type(), page,
+      Builder->CreateAnd(index, KL_ARRAY_PAGE_SIZE - 1, "slot"), "entry");
+}
+
+static Value *create_array_field(Value *entry, unsigned field,
+                                 const Twine &name) {
+  auto *type = get_array_entry_type();
+  auto *load =
+      Builder->CreateLoad(type->getElementType(field),
+                          Builder->CreateStructGEP(type, entry, field), name);
+  load->setMetadata(LLVMContext::MD_tbaa, get_tbaa_tag("array entry"));
+  return load;
+}
+
+static FunctionCallee get_bounds_error() {
+  auto callee = TheModule->getOrInsertFunction(
+      "kl_bounds_error", Builder->getVoidTy(), Builder->getInt64Ty(),
+      Builder->getInt64Ty());
+  auto *f = cast<Function>(callee.getCallee());
+  f->setDoesNotReturn();
+  f->setDoesNotThrow();
+  f->addFnAttr(Attribute::Cold);
+  return callee;
+}
+
+Value *IndexExprAST::codegen_address() {
+  auto *array = Array->codegen();
+  if (!array)
+    return nullptr;
+  bool integer = Index->is_integer();
+  auto *index = integer ? Index->codegen_integer() : Index->codegen();
+  if (!index)
+    return nullptr;
+  if (!integer)
+    index = create_array_index(index, "index");
+
+  DebugInfoInserter::emit_location(this);
+  auto *entry = create_array_entry(array);
+  if (BOUNDS_CHECK) {
+    auto *length = create_array_field(entry, 1, "length");
+    auto *f = Builder->GetInsertBlock()->getParent();
+    auto *fail_bb = BasicBlock::Create(*TheContext, "out-of-bounds", f);
+    auto *ok_bb = BasicBlock::Create(*TheContext, "in-bounds", f);
+    // Negative indices compare as huge unsigned ones.
+    Builder->CreateCondBr(Builder->CreateICmpULT(index, length), ok_bb,
+                          fail_bb);
+    Builder->SetInsertPoint(fail_bb);
+    Builder->CreateCall(get_bounds_error(), {index, length});
+    Builder->CreateUnreachable();
+    Builder->SetInsertPoint(ok_bb);
+  }
+  auto *data = create_array_field(entry, 0, "data");
+  return Builder->CreateInBoundsGEP(get_num_type(), data, index, "element");
+}
+
+Value *IndexExprAST::codegen() {
+  auto *address = codegen_address();
+  if (!address)
+    return nullptr;
+  auto *load = Builder->CreateLoad(get_num_type(), address, "elementtmp");
+  load->setMetadata(LLVMContext::MD_tbaa, get_tbaa_tag("num"));
+  return load;
+}
+
+// array(n), len(a) and free(a), unless the program defines functions of
+// those names
+static bool is_array_builtin(const std::string &name, size_t arg_count) {
+  return (name == "array" || name == "len" || name == "free") &&
+         arg_count == 1 && !get_function(name);
+}
+
+Value *CallExprAST::codegen_array_builtin() {
+  auto *arg = Args[0]->codegen();
+  if (!arg)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+  auto *int64_type = Builder->getInt64Ty();
+  if (Callee == "array") {
+    auto runtime = TheModule->getOrInsertFunction("kl_array_new", int64_type,
+                                                  int64_type, int64_type);
+    auto element_size =
+        TheModule->getDataLayout().getTypeAllocSize(get_num_type());
+    auto *handle = Builder->CreateCall(
+        runtime, {create_array_index(arg, "length"),
+                  Builder->getInt64(element_size)});
+    return Builder->CreateSIToFP(handle, get_num_type(), "array");
+  }
+  if (Callee == "free") {
+    auto runtime = TheModule->getOrInsertFunction(
+        "kl_array_free", Builder->getVoidTy(), int64_type);
+    Builder->CreateCall(runtime, create_array_index(arg, "handle"));
+    return get_num(0.0);
+  }
+  auto *length = create_array_field(create_array_entry(arg), 1, "length");
+  return Builder->CreateSIToFP(length, get_num_type(), "len");
 }
 
 Value *BinaryExprAST::codegen() {
 
   // assignment
   if (Op == "=") {
+    if (auto *element = dyn_cast<IndexExprAST>(LHS.get())) {
+      Value *val = RHS->codegen();
+      if (!val)
+        return nullptr;
+      auto *address = element->codegen_address();
+      if (!address)
+        return nullptr;
+
+      DebugInfoInserter::emit_location(this);
+      auto *store = Builder->CreateStore(val, address);
+      store->setMetadata(LLVMContext::MD_tbaa, get_tbaa_tag("num"));
+      return val;
+    }
+
     // We use LLVM-style RTTI so we can do error checking
     auto LHSE = dyn_cast<VariableExprAST>(LHS.get());
 
     if (!LHSE)
       return log_error_v(
-          "Left hand side of assignment should be a valid identifier.");
+          "Left hand side of assignment should be a variable or an element.");
 
     Value *val = RHS->codegen();
     if (!val)
@@ -64,6 +290,22 @@ Value *BinaryExprAST::codegen() {
     return val; // assignment returns value as C and C++
   }
 
+  // Integer sums are converted once, where their value is used as a number.
+  if (is_integer()) {
+    auto *value = codegen_integer();
+    if (!value)
+      return nullptr;
+    return Builder->CreateSIToFP(value, get_num_type(), "numtmp");
+  }
+
+  if (Op == "<" || Op == ">") {
+    auto *condition = codegen_condition();
+    if (!condition)
+      return nullptr;
+    // Convert bool 0/1 to 0.0 or 1.0
+    return Builder->CreateUIToFP(condition, get_num_type(), "booltmp");
+  }
+
   Value *L = LHS->codegen();
   Value *R = RHS->codegen();
   if (!L || !R)
@@ -77,15 +319,6 @@ Value *BinaryExprAST::codegen() {
     return Builder->CreateFSub(L, R, "subtmp");
   if (Op == "*")
     return Builder->CreateFMul(L, R, "multmp");
-  if (Op == "<") {
-    L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-  }
-  if (Op == ">") {
-    L = Builder->CreateFCmpULT(R, L, "cmptmp");
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp");
-  }
 
   auto *f = get_function(std::string("binary") + Op);
   if (!f)
@@ -93,7 +326,40 @@ Value *BinaryExprAST::codegen() {
         std::format("Binary operator `{}` not found", Op).c_str());
 
   Value *Ops[2] = {L, R};
-  return Builder->CreateCall(f, Ops, "binop");
+  return create_call(f, Ops, TailPosition, "binop");
+}
+
+// The bound of the result is exact, so it is the one floating point arithmetic
+// would give.
+Value *BinaryExprAST::codegen_integer() {
+  Value *L = LHS->codegen_integer();
+  Value *R = RHS->codegen_integer();
+  if (!L || !R)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+  if (Op == "+")
+    return Builder->CreateNSWAdd(L, R, "addtmp");
+  return Builder->CreateNSWSub(L, R, "subtmp");
+}
+
+// Comparisons are branched on directly rather than through 0.0 and 1.0, and
+// compare integers as integers.
+Value *BinaryExprAST::codegen_condition() {
+  if (Op != "<" && Op != ">")
+    return ExprAST::codegen_condition();
+
+  bool integer = LHS->is_integer() && RHS->is_integer();
+  Value *L = integer ? LHS->codegen_integer() : LHS->codegen();
+  Value *R = integer ? RHS->codegen_integer() : RHS->codegen();
+  if (!L || !R)
+    return nullptr;
+
+  DebugInfoInserter::emit_location(this);
+  if (Op == ">")
+    std::swap(L, R);
+  return integer ? Builder->CreateICmpSLT(L, R, "cmptmp")
+                 : Builder->CreateFCmpULT(L, R, "cmptmp");
 }
 
 Value *UnaryExprAST::codegen() {
@@ -107,19 +373,31 @@ Value *UnaryExprAST::codegen() {
     return nullptr;
 
   DebugInfoInserter::emit_location(this);
-  return Builder->CreateCall(f, operand);
+  return create_call(f, operand, TailPosition, "");
 }
 
 Value *CallExprAST::codegen() {
-  Function *CalleeF = get_function(Callee);
-  if (!CalleeF)
-    return log_error_v(
-        std::format("Unknown function {} referenced", Callee).c_str());
+  if (is_array_builtin(Callee, Args.size()))
+    return codegen_array_builtin();
+
+  // Math functions compile to intrinsics, which LLVM constant-folds,
+  // vectorizes and, e.g. for sqrt, lowers to single instructions.
+  auto intrinsic = Definitions.count(Callee)
+                       ? Intrinsic::not_intrinsic
+                       : get_math_intrinsic(Callee, Args.size());
+
+  Function *CalleeF = nullptr;
+  if (intrinsic == Intrinsic::not_intrinsic) {
+    CalleeF = get_function(Callee);
+    if (!CalleeF)
+      return log_error_v(
+          std::format("Unknown function {} referenced", Callee).c_str());
 
-  if (CalleeF->arg_size() != Args.size())
-    return log_error_v(
-        std::format("Incorrect number of arguments for function {}", Callee)
-            .c_str());
+    if (CalleeF->arg_size() != Args.size())
+      return log_error_v(
+          std::format("Incorrect number of arguments for function {}", Callee)
+              .c_str());
+  }
 
   DebugInfoInserter::emit_location(this);
 
@@ -129,7 +407,10 @@ Value *CallExprAST::codegen() {
     if (!ArgsV.back()) // if the last element is nullptr
       return nullptr;
   }
-  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  if (intrinsic != Intrinsic::not_intrinsic)
+    return Builder->CreateIntrinsic(intrinsic, {get_num_type()}, ArgsV,
+                                    nullptr, "calltmp");
+  return create_call(CalleeF, ArgsV, TailPosition, "calltmp");
 }
 
 Function *PrototypeAST::codegen() {
@@ -141,11 +422,16 @@ Function *PrototypeAST::codegen() {
           "`main` function should not have arguments");
     FT = FunctionType::get(Type::getInt32Ty(*TheContext), false);
   } else {
-    std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-    FT = FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+    std::vector<Type *> Numbers(Args.size(), get_num_type());
+    FT = FunctionType::get(get_num_type(), Numbers, false);
   }
-  Function *F =
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+  Function *F = Function::Create(FT, Function::ExternalLinkage,
+                                 symbol_name(Name), TheModule.get());
+  if (IsPure)
+    declare_pure(Name);
+  apply_known_effects(*F);
+  if (IsPure && SIMD_VARIANTS)
+    declare_simd_variants(*F);
 
   unsigned idx = 0;
   for (auto &arg : F->args())
@@ -157,6 +443,86 @@ Function *PrototypeAST::codegen() {
   return F;
 }
 
+namespace {
+// The runtime's cache of a `memo def` function (kl_memo_* in external.cpp)
+struct MemoCache {
+  GlobalVariable *Slot = nullptr; // the cache, created on first use
+  GlobalVariable *Name = nullptr; // for memostats()
+  AllocaInst *Key = nullptr;      // the arguments, whose bits are the key
+};
+} // namespace
+
+// Returns the cached result if there is one; code emitted after this runs on
+// a miss.
+static MemoCache create_memo_lookup(Function *F) {
+  auto *ptr_ty = Builder->getPtrTy();
+  auto *num_ty = get_num_type();
+  auto *int_ty = Builder->getInt32Ty();
+
+  MemoCache memo;
+  // Copies in other modules, such as specializations, declare the slot, so
+  // they share the cache.
+  memo.Slot = new GlobalVariable(*TheModule, ptr_ty, false,
+                                 GlobalValue::ExternalLinkage,
+                                 ConstantPointerNull::get(ptr_ty),
+                                 F->getName() + ".memo");
+  memo.Name = Builder->CreateGlobalString(F->getName(), F->getName() + ".name");
+
+  auto *key_ty =
+      ArrayType::get(num_ty, std::max<size_t>(F->arg_size(), 1));
+  memo.Key = Builder->CreateAlloca(key_ty, nullptr, "memo.key");
+  for (auto &arg : F->args())
+    Builder->CreateStore(&arg, Builder->CreateConstInBoundsGEP2_32(
+                                   key_ty, memo.Key, 0, arg.getArgNo()));
+  auto *result = Builder->CreateAlloca(num_ty, nullptr, "memo.result");
+
+  auto lookup = TheModule->getOrInsertFunction(
+      "kl_memo_lookup",
+      FunctionType::get(int_ty, {ptr_ty, ptr_ty, ptr_ty, int_ty, ptr_ty},
+                        false));
+  auto *hit = Builder->CreateCall(
+      lookup, {memo.Slot, memo.Name, memo.Key,
+               Builder->getInt32(F->arg_size()), result});
+
+  auto *hit_bb = BasicBlock::Create(*TheContext, "memo.hit", F);
+  auto *miss_bb = BasicBlock::Create(*TheContext, "memo.miss", F);
+  Builder->CreateCondBr(Builder->CreateICmpNE(hit, Builder->getInt32(0)),
+                        hit_bb, miss_bb);
+  Builder->SetInsertPoint(hit_bb);
+  Builder->CreateRet(Builder->CreateLoad(num_ty, result));
+
+  Builder->SetInsertPoint(miss_bb);
+  return memo;
+}
+
+static void create_memo_store(const MemoCache &memo, Function *F,
+                              Value *value) {
+  auto store = TheModule->getOrInsertFunction(
+      "kl_memo_store",
+      FunctionType::get(Builder->getVoidTy(),
+                        {Builder->getPtrTy(), Builder->getPtrTy(),
+                         Builder->getInt32Ty(), get_num_type()},
+                        false));
+  Builder->CreateCall(store, {memo.Slot, memo.Key,
+                              Builder->getInt32(F->arg_size()), value});
+}
+
+// The backend takes the fast-math options from function attributes; the
+// instructions carry the flags of Builder.
+static void add_fast_math_attributes(Function &F) {
+  auto flags = Builder->getFastMathFlags();
+  if (flags.noNaNs())
+    F.addFnAttr("no-nans-fp-math", "true");
+  if (flags.noInfs())
+    F.addFnAttr("no-infs-fp-math", "true");
+  if (flags.noSignedZeros())
+    F.addFnAttr("no-signed-zeros-fp-math", "true");
+  if (flags.approxFunc())
+    F.addFnAttr("approx-func-fp-math", "true");
+  if (flags.isFast())
+    F.addFnAttr("unsafe-fp-math", "true");
+}
+
 Function *FunctionAST::codegen() {
 
   auto &p = *Proto;
@@ -175,6 +541,10 @@ Function *FunctionAST::codegen() {
                     Proto->get_name(), F->arg_size(), Proto->get_arg_size())
             .c_str());
 
+  if (IsMemo && F->getName() == "main")
+    return (Function *)log_error_v("`main` can not be a memo function");
+
+  add_fast_math_attributes(*F);
   BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
   Builder->SetInsertPoint(BB);
   DebugInfoInserter DII;
@@ -182,6 +552,7 @@ Function *FunctionAST::codegen() {
   DII.insert_subprogram(p.get_line(), F);
   // Record the function arguments in the NamedValues map.
   NamedValues.clear();
+  IntegerBounds.clear();
   for (auto &arg : F->args()) {
     AllocaInst *arg_alloca = create_entry_block_alloca(F, arg.getName());
     DII.insert_function_parameter(p.get_line(), arg, arg_alloca);
@@ -189,22 +560,47 @@ Function *FunctionAST::codegen() {
     NamedValues[std::string(arg.getName())] = arg_alloca;
   }
 
+  MemoCache memo;
+  if (IsMemo)
+    memo = create_memo_lookup(F);
+
+  // `main` returns 0 instead of its body, and memo functions store the value
+  // before returning it.
+  if (F->getName() != "main" && !IsMemo)
+    Body->mark_tail_position();
+
   // DII.emit_location(Body.get());
   if (Value *ret_value = Body->codegen()) {
 
-    if (F->getName() == "main")
+    if (F->getName() == "main") {
       Builder->CreateRet(ConstantInt::get(*TheContext, APInt(32, 0, true)));
-    else
+    } else if (IsMemo) {
+      create_memo_store(memo, F, ret_value);
       Builder->CreateRet(ret_value);
+    } else {
+      create_tail_return(ret_value);
+    }
 
     verifyFunction(*F);
-    if (!DEBUG)
-      TheFPM->run(*F, *TheFAM);
 
-    return F;
+    // A cached result must be the result a call would compute. Writing the
+    // cache itself, or the caches of memo callees, is allowed.
+    if (IsMemo && !analyze_effects(*F).ReadNone) {
+      log_error(std::format("`{}` can not be memoized because it is not pure",
+                            F->getName().str())
+                    .c_str());
+    } else {
+      Definitions.insert(p.get_name());
+      optimize_function(*F);
+      return F;
+    }
   }
   DII.reset_scope();
   F->eraseFromParent();
+  if (IsMemo) {
+    memo.Slot->eraseFromParent();
+    memo.Name->eraseFromParent();
+  }
   return nullptr;
 }
 
@@ -212,14 +608,10 @@ Value *IfExprAST::codegen() {
 
   DebugInfoInserter::emit_location(this);
 
-  Value *cond_val = Condition->codegen();
-
-  if (!cond_val)
+  auto *bool_cond = Condition->codegen_condition();
+  if (!bool_cond)
     return nullptr;
 
-  auto *bool_cond = Builder->CreateFCmpONE(
-      cond_val, ConstantFP::get(*TheContext, APFloat(0.0)), "ifcond");
-
   Function *f = Builder->GetInsertBlock()->getParent();
 
   auto *then_bb = BasicBlock::Create(*TheContext, "then", f);
@@ -232,7 +624,12 @@ Value *IfExprAST::codegen() {
   Value *then_val = Then->codegen();
   if (!then_val)
     return nullptr;
-  Builder->CreateBr(fin_bb);
+  // In tail position each branch returns on its own, so a call in a branch is
+  // directly followed by its `ret`.
+  if (TailPosition)
+    create_tail_return(then_val);
+  else
+    Builder->CreateBr(fin_bb);
   auto *then_phi_bb = Builder->GetInsertBlock();
 
   f->insert(f->end(), else_bb);
@@ -241,79 +638,491 @@ Value *IfExprAST::codegen() {
   if (!else_val)
     return nullptr;
 
+  if (TailPosition) {
+    create_tail_return(else_val);
+    delete fin_bb;
+    return PoisonValue::get(get_num_type());
+  }
   Builder->CreateBr(fin_bb);
   auto *else_phi_bb = Builder->GetInsertBlock();
 
   f->insert(f->end(), fin_bb);
   Builder->SetInsertPoint(fin_bb);
-  auto *ret_val =
-      Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2, "iftmp");
+  auto *ret_val = Builder->CreatePHI(get_num_type(), 2, "iftmp");
   ret_val->addIncoming(then_val, then_phi_bb);
   ret_val->addIncoming(else_val, else_phi_bb);
 
   return ret_val;
 }
 
+// The llvm.loop metadata of the hints, or null when there are none.
+static MDNode *create_loop_id(const LoopHints &hints) {
+  // The first operand is the loop ID itself.
+  SmallVector<Metadata *, 4> operands{nullptr};
+  auto add = [&](StringRef name, Constant *value = nullptr) {
+    SmallVector<Metadata *, 2> hint{MDString::get(*TheContext, name)};
+    if (value)
+      hint.push_back(ConstantAsMetadata::get(value));
+    operands.push_back(MDNode::get(*TheContext, hint));
+  };
+
+  switch (hints.Unroll.Kind) {
+  case LoopHint::Unset:
+    break;
+  case LoopHint::Enable:
+    add("llvm.loop.unroll.enable");
+    break;
+  case LoopHint::Disable:
+    add("llvm.loop.unroll.disable");
+    break;
+  case LoopHint::Full:
+    add("llvm.loop.unroll.full");
+    break;
+  case LoopHint::Count:
+    add("llvm.loop.unroll.count", Builder->getInt32(hints.Unroll.Value));
+    break;
+  }
+
+  // A width or interleave count of 1 is what keeps the vectorizer away.
+  bool vectorize = hints.Vectorize.Kind == LoopHint::Enable ||
+                   hints.Interleave.Kind == LoopHint::Enable;
+  if (hints.Vectorize.Kind == LoopHint::Disable)
+    add("llvm.loop.vectorize.width", Builder->getInt32(1));
+  if (hints.Vectorize.Kind == LoopHint::Count) {
+    add("llvm.loop.vectorize.width", Builder->getInt32(hints.Vectorize.Value));
+    vectorize |= hints.Vectorize.Value > 1;
+  }
+  if (hints.Interleave.Kind == LoopHint::Disable)
+    add("llvm.loop.interleave.count", Builder->getInt32(1));
+  if (hints.Interleave.Kind == LoopHint::Count)
+    add("llvm.loop.interleave.count",
+        Builder->getInt32(hints.Interleave.Value));
+  if (vectorize)
+    add("llvm.loop.vectorize.enable", Builder->getTrue());
+
+  if (operands.size() == 1)
+    return nullptr;
+  auto *loop_id = MDNode::getDistinct(*TheContext, operands);
+  loop_id->replaceOperandWith(0, loop_id);
+  return loop_id;
+}
+
+// Combines two values of a reduction. The operation may be reassociated, which
+// lets the loop vectorizer keep a partial result per lane.
+static Value *create_reduce_op(ReduceOp op, Value *result, Value *value) {
+  IRBuilder<>::FastMathFlagGuard guard(*Builder);
+  auto flags = Builder->getFastMathFlags();
+  flags.setAllowReassoc();
+  Builder->setFastMathFlags(flags);
+
+  switch (op) {
+  case ReduceOp::Add:
+    return Builder->CreateFAdd(result, value, "reduce");
+  case ReduceOp::Mul:
+    return Builder->CreateFMul(result, value, "reduce");
+  case ReduceOp::Min:
+    return Builder->CreateMinNum(result, value, "reduce");
+  case ReduceOp::Max:
+    return Builder->CreateMaxNum(result, value, "reduce");
+  default:
+    return result;
+  }
+}
+
+// A reduction's running result, starting from the identity of its operator
+static AllocaInst *create_reduce_result(ReduceOp op, Function *function) {
+  if (op == ReduceOp::None)
+    return nullptr;
+  auto *result = create_entry_block_alloca(function, "reduce");
+  Builder->CreateStore(get_num(get_reduce_identity(op)), result);
+  return result;
+}
+
+// Loops are emitted in the canonical form LLVM's loop passes expect: the
+// condition is tested once in a guard and then again, rotated, in the single
+// latch, and the loop variable is a PHI in the header. It is still mirrored in
+// an alloca so the body can assign to it; mem2reg folds the two together.
+//
+//   guard:      br cond(start), preheader, endfor
+//   preheader:  br loop
+//   loop:       i = phi [start, preheader], [next, latch]
+//               body
+//   latch:      next = i + step
+//               br cond(next), loop, endfor, !llvm.loop hints
+//
+// A counter with integer bounds that nothing assigns counts in i64: the loop
+// passes understand integer induction variables far better than floating
+// point ones. Its uses see it converted to a number. When the end is only
+// known at runtime, e.g. a parameter, the loop is emitted twice: the i64
+// version runs if the end is in the range where both versions count the same,
+// the floating point one otherwise.
 Value *ForExprAST::codegen() {
+  if (IsParallel)
+    return codegen_parallel();
+
+  if (auto bound = get_counter_bound())
+    return codegen_loop(bound, nullptr);
+  auto checked = get_checked_end();
+  if (!checked)
+    return codegen_loop(std::nullopt, nullptr);
+
+  DebugInfoInserter::emit_location(this);
+  Value *end = checked->End->codegen();
+  if (!end)
+    return nullptr;
+  auto *in_range = Builder->CreateFCmpOLE(
+      Builder->CreateUnaryIntrinsic(Intrinsic::fabs, end),
+      get_num(checked->Limit), "in-range");
+
+  auto *f = Builder->GetInsertBlock()->getParent();
+  auto *integer_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-integer", VarName), f);
+  auto *float_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-float", VarName));
+  auto *merge_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-merge", VarName));
+  Builder->CreateCondBr(in_range, integer_bb, float_bb);
+
+  // An integer is below the end if it is below the end rounded up, and above
+  // it if it is above the end rounded down.
+  Builder->SetInsertPoint(integer_bb);
+  auto *rounded = Builder->CreateUnaryIntrinsic(
+      checked->Up ? Intrinsic::ceil : Intrinsic::floor, end);
+  auto *integer_result = codegen_loop(
+      checked->Limit + checked->Step,
+      Builder->CreateFPToSI(rounded, Builder->getInt64Ty(), "end"));
+  if (!integer_result)
+    return nullptr;
+  integer_bb = Builder->GetInsertBlock();
+  Builder->CreateBr(merge_bb);
+
+  f->insert(f->end(), float_bb);
+  Builder->SetInsertPoint(float_bb);
+  auto *float_result = codegen_loop(std::nullopt, nullptr);
+  if (!float_result)
+    return nullptr;
+  float_bb = Builder->GetInsertBlock();
+  Builder->CreateBr(merge_bb);
+
+  f->insert(f->end(), merge_bb);
+  Builder->SetInsertPoint(merge_bb);
+  auto *result = Builder->CreatePHI(get_num_type(), 2, "loop-result");
+  result->addIncoming(integer_result, integer_bb);
+  result->addIncoming(float_result, float_bb);
+  return result;
+}
+
+// The loop itself, counting in i64 if `bound` is set. An integer loop tests
+// its condition by comparing with `end` if that is set; the variable then
+// counts towards it.
+Value *ForExprAST::codegen_loop(std::optional<double> bound, Value *end) {
+  bool integer = bound.has_value();
+  auto *var_type = integer ? Builder->getInt64Ty() : get_num_type();
 
   AllocaInst *var_alloc = create_entry_block_alloca(
-      Builder->GetInsertBlock()->getParent(), VarName);
+      Builder->GetInsertBlock()->getParent(), VarName, var_type);
+  if (integer)
+    IntegerBounds[var_alloc] = *bound;
 
   DebugInfoInserter::emit_location(this);
 
-  Value *start = Start->codegen();
+  Value *start = integer ? Start->codegen_integer() : Start->codegen();
   if (!start)
     return nullptr;
 
   Builder->CreateStore(start, var_alloc);
+  auto *result = create_reduce_result(
+      Reduction, Builder->GetInsertBlock()->getParent());
+
+  auto *old_pointer = NamedValues[VarName];
+  NamedValues[VarName] = var_alloc;
 
   auto *f = Builder->GetInsertBlock()->getParent();
+  auto *preheader_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-preheader", VarName));
   auto *loop_bb =
-      BasicBlock::Create(*TheContext, std::format("{}-loop", VarName), f);
+      BasicBlock::Create(*TheContext, std::format("{}-loop", VarName));
   auto *end_bb =
       BasicBlock::Create(*TheContext, std::format("{}-endfor", VarName));
 
+  auto create_exit_test = [&](BasicBlock *continue_bb) {
+    Value *condition;
+    if (end)
+      condition = Builder->CreateICmp(
+          cast<NumberExprAST>(Step.get())->get_value() > 0 ? CmpInst::ICMP_SLT
+                                                           : CmpInst::ICMP_SGT,
+          Builder->CreateLoad(var_type, var_alloc, VarName), end, "cond");
+    else
+      condition = Condition->codegen_condition();
+    if (!condition)
+      return false;
+    Builder->CreateCondBr(condition, continue_bb, end_bb);
+    return true;
+  };
+
+  // Check the condition even on the first iteration
+  if (!create_exit_test(preheader_bb))
+    return nullptr;
+
+  f->insert(f->end(), preheader_bb);
+  Builder->SetInsertPoint(preheader_bb);
   Builder->CreateBr(loop_bb);
 
+  f->insert(f->end(), loop_bb);
   Builder->SetInsertPoint(loop_bb);
+  auto *variable = Builder->CreatePHI(var_type, 2, VarName);
+  variable->addIncoming(start, preheader_bb);
+  Builder->CreateStore(variable, var_alloc);
 
-  auto *old_pointer = NamedValues[VarName];
-  NamedValues[VarName] = var_alloc;
+  // generate Body
+  auto *body = Body->codegen();
+  if (!body)
+    return nullptr;
+  if (result)
+    Builder->CreateStore(
+        create_reduce_op(Reduction,
+                         Builder->CreateLoad(get_num_type(), result), body),
+        result);
 
-  Value *condition = Condition->codegen();
-  if (!condition)
+  Value *step = integer ? Step->codegen_integer() : Step->codegen();
+  if (!step)
     return nullptr;
-  auto *bool_cond = Builder->CreateFCmpONE(
-      condition, ConstantFP::get(*TheContext, APFloat(0.0)),
-      std::format("{}-forcond", VarName));
-  auto *branch = Builder->CreateBr(end_bb);
 
-  // Check the condition even on the first iteration
-  auto *then_inst = SplitBlockAndInsertIfThen(bool_cond, branch, false);
-  auto *split_bb = then_inst->getParent();
-  Builder->SetInsertPoint(split_bb);
-  then_inst->eraseFromParent();
+  // The body may have assigned to the variable, so continue from the alloca.
+  auto *current = Builder->CreateLoad(var_type, var_alloc);
+  auto next_name = std::format("{}-nextvar", VarName);
+  auto *next = integer ? Builder->CreateNSWAdd(current, step, next_name)
+                       : Builder->CreateFAdd(current, step, next_name);
+  Builder->CreateStore(next, var_alloc);
 
-  // generate Body
-  auto *body = Body->codegen();
-  if (!body)
+  if (!create_exit_test(loop_bb))
+    return nullptr;
+  variable->addIncoming(next, Builder->GetInsertBlock());
+  if (auto *loop_id = create_loop_id(Hints))
+    Builder->GetInsertBlock()->getTerminator()->setMetadata(
+        LLVMContext::MD_loop, loop_id);
+
+  f->insert(f->end(), end_bb);
+  Builder->SetInsertPoint(end_bb);
+  NamedValues[VarName] = old_pointer;
+  if (result)
+    return Builder->CreateLoad(get_num_type(), result, "reduce");
+  return get_num(0.0);
+}
+
+// Parallel loop bodies are numbered so their names are never reused, even when
+// the function containing the loop is redefined.
+static unsigned ParforCount = 0;
+
+// The loop `var < end` or `end > var` of a parfor stops at; null for other
+// conditions.
+static ExprAST *get_parallel_limit(ExprAST *condition,
+                                   const std::string &var_name) {
+  auto *binary = dyn_cast<BinaryExprAST>(condition);
+  if (!binary)
     return nullptr;
 
+  auto is_var = [&](ExprAST *expr) {
+    auto *variable = dyn_cast<VariableExprAST>(expr);
+    return variable && variable->get_name() == var_name;
+  };
+  if (binary->get_op() == "<" && is_var(binary->get_lhs()))
+    return binary->get_rhs();
+  if (binary->get_op() == ">" && is_var(binary->get_rhs()))
+    return binary->get_lhs();
+  return nullptr;
+}
+
+// The body of a parfor is outlined into
+//   void parent.parforN(ptr env, i64 begin, i64 end)
+// which runs iterations [begin, end), with the variable at start + k * step on
+// iteration k. kl_parallel_for calls it with chunks of the iterations from its
+// worker threads. The variables in scope are copied into `env`, so what an
+// iteration assigns to them is private to that iteration. For a parreduce the
+// outlined function returns the reduction of its chunk, and
+// kl_parallel_reduce combines those.
+Value *ForExprAST::codegen_parallel() {
+  ExprAST *End = get_parallel_limit(Condition.get(), VarName);
+  if (!End)
+    return log_error_v(
+        std::format("A parallel loop needs a condition `{0} < end` or "
+                    "`end > {0}`",
+                    VarName)
+            .c_str());
+
+  auto bound = get_counter_bound();
+  bool integer = bound.has_value();
+  auto *var_type = integer ? Builder->getInt64Ty() : get_num_type();
+  auto *index_type = Builder->getInt64Ty();
+
+  DebugInfoInserter::emit_location(this);
+
+  // The bounds and the step are evaluated once, before the loop.
+  Value *start = Start->codegen();
+  if (!start)
+    return nullptr;
+  Value *limit = End->codegen();
+  if (!limit)
+    return nullptr;
   Value *step = Step->codegen();
   if (!step)
     return nullptr;
 
+  // An empty range, a step that does not move towards the end and NaN all
+  // run no iterations.
+  auto *trips = Builder->CreateUnaryIntrinsic(
+      Intrinsic::ceil,
+      Builder->CreateFDiv(Builder->CreateFSub(limit, start), step));
+  auto *valid =
+      Builder->CreateAnd(Builder->CreateFCmpOGT(trips, get_num(0.0)),
+                         Builder->CreateFCmpOLT(trips, get_num(0x1p53)));
+  auto *count = Builder->CreateSelect(
+      valid, Builder->CreateFPToSI(trips, index_type), Builder->getInt64(0),
+      "parfor-count");
+
+  std::vector<std::pair<std::string, AllocaInst *>> captured;
+  std::vector<Type *> env_types;
+  for (auto &[name, alloca] : NamedValues)
+    if (alloca && name != VarName) {
+      captured.emplace_back(name, alloca);
+      env_types.push_back(alloca->getAllocatedType());
+    }
+  env_types.push_back(get_num_type()); // start
+  env_types.push_back(get_num_type()); // step
+  auto *env_type = StructType::get(*TheContext, env_types);
+
+  auto *parent = Builder->GetInsertBlock()->getParent();
+  auto *env = create_entry_block_alloca(parent, "parfor-env", env_type);
+  for (unsigned i = 0, e = captured.size(); i != e; ++i) {
+    auto *alloca = captured[i].second;
+    Builder->CreateStore(
+        Builder->CreateLoad(alloca->getAllocatedType(), alloca),
+        Builder->CreateStructGEP(env_type, env, i));
+  }
   Builder->CreateStore(
-      Builder->CreateFAdd(
-          Builder->CreateLoad(Type::getDoubleTy(*TheContext), var_alloc), step,
-          std::format("{}-nextvar", VarName)),
-      var_alloc);
-  Builder->CreateBr(loop_bb);
+      start, Builder->CreateStructGEP(env_type, env, captured.size()));
+  Builder->CreateStore(
+      step, Builder->CreateStructGEP(env_type, env, captured.size() + 1));
+
+  auto *body_type = FunctionType::get(
+      Reduction == ReduceOp::None ? Builder->getVoidTy() : get_num_type(),
+      {Builder->getPtrTy(), index_type, index_type}, false);
+  auto *body_fn = Function::Create(
+      body_type, Function::ExternalLinkage,
+      std::format("{}.parfor{}", parent->getName().str(), ParforCount++),
+      TheModule.get());
+  add_fast_math_attributes(*body_fn);
+
+  auto saved_ip = Builder->saveIP();
+  auto saved_location = Builder->getCurrentDebugLocation();
+  auto saved_values = std::move(NamedValues);
+  NamedValues.clear();
+  auto restore = [&] {
+    Builder->restoreIP(saved_ip);
+    Builder->SetCurrentDebugLocation(saved_location);
+    NamedValues = std::move(saved_values);
+  };
+
+  auto *entry_bb = BasicBlock::Create(*TheContext, "entry", body_fn);
+  Builder->SetInsertPoint(entry_bb);
+  DebugInfoInserter DII;
+  DII.insert_subprogram(get_line(), body_fn);
+
+  auto *body_env = body_fn->getArg(0);
+  auto *begin = body_fn->getArg(1);
+  auto *end = body_fn->getArg(2);
+  for (unsigned i = 0, e = captured.size(); i != e; ++i) {
+    auto &[name, alloca] = captured[i];
+    auto *type = alloca->getAllocatedType();
+    auto *copy = create_entry_block_alloca(body_fn, name, type);
+    if (auto bound = IntegerBounds.find(alloca); bound != IntegerBounds.end())
+      IntegerBounds[copy] = bound->second;
+    Builder->CreateStore(
+        Builder->CreateLoad(type,
+                            Builder->CreateStructGEP(env_type, body_env, i)),
+        copy);
+    NamedValues[name] = copy;
+  }
+  Value *first = Builder->CreateLoad(
+      get_num_type(),
+      Builder->CreateStructGEP(env_type, body_env, captured.size()));
+  Value *stride = Builder->CreateLoad(
+      get_num_type(),
+      Builder->CreateStructGEP(env_type, body_env, captured.size() + 1));
+  if (integer) {
+    first = Builder->CreateFPToSI(first, var_type);
+    stride = Builder->CreateFPToSI(stride, var_type);
+  }
 
-  f->insert(f->end(), end_bb);
+  auto *var_alloc = create_entry_block_alloca(body_fn, VarName, var_type);
+  if (integer)
+    IntegerBounds[var_alloc] = *bound;
+  NamedValues[VarName] = var_alloc;
+  auto *result = create_reduce_result(Reduction, body_fn);
+
+  auto *loop_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-loop", VarName), body_fn);
+  auto *end_bb =
+      BasicBlock::Create(*TheContext, std::format("{}-endfor", VarName));
+  Builder->CreateCondBr(Builder->CreateICmpSLT(begin, end), loop_bb, end_bb);
+
+  Builder->SetInsertPoint(loop_bb);
+  auto *k = Builder->CreatePHI(index_type, 2, "k");
+  k->addIncoming(begin, entry_bb);
+  auto *variable =
+      integer ? Builder->CreateAdd(first, Builder->CreateMul(k, stride))
+              : Builder->CreateFAdd(
+                    first, Builder->CreateFMul(
+                               Builder->CreateSIToFP(k, var_type), stride));
+  Builder->CreateStore(variable, var_alloc);
+
+  auto *body = Body->codegen();
+  if (!body) {
+    DII.reset_scope();
+    restore();
+    body_fn->eraseFromParent();
+    return nullptr;
+  }
+  if (result)
+    Builder->CreateStore(
+        create_reduce_op(Reduction,
+                         Builder->CreateLoad(get_num_type(), result), body),
+        result);
+
+  auto *next = Builder->CreateNSWAdd(k, Builder->getInt64(1), "k-next");
+  Builder->CreateCondBr(Builder->CreateICmpSLT(next, end), loop_bb, end_bb);
+  k->addIncoming(next, Builder->GetInsertBlock());
+  if (auto *loop_id = create_loop_id(Hints))
+    Builder->GetInsertBlock()->getTerminator()->setMetadata(
+        LLVMContext::MD_loop, loop_id);
+
+  body_fn->insert(body_fn->end(), end_bb);
   Builder->SetInsertPoint(end_bb);
-  NamedValues[VarName] = old_pointer;
-  return ConstantFP::get(*TheContext, APFloat(0.0));
+  if (result)
+    Builder->CreateRet(Builder->CreateLoad(get_num_type(), result));
+  else
+    Builder->CreateRetVoid();
+  DII.reset_scope();
+  restore();
+
+  verifyFunction(*body_fn);
+  optimize_function(*body_fn);
+
+  if (Reduction != ReduceOp::None) {
+    auto runtime = TheModule->getOrInsertFunction(
+        "kl_parallel_reduce", get_num_type(), Builder->getPtrTy(),
+        Builder->getPtrTy(), index_type, Builder->getInt32Ty());
+    return Builder->CreateCall(
+        runtime, {body_fn, env, count,
+                  Builder->getInt32(static_cast<int>(Reduction))},
+        "reduce");
+  }
+
+  auto runtime = TheModule->getOrInsertFunction(
+      "kl_parallel_for", Builder->getVoidTy(), Builder->getPtrTy(),
+      Builder->getPtrTy(), index_type);
+  Builder->CreateCall(runtime, {body_fn, env, count});
+  return get_num(0.0);
 }
 
 Value *WithExprAST::codegen() {
@@ -333,10 +1142,11 @@ Value *WithExprAST::codegen() {
       if (!initial_val)
         return nullptr;
     } else {
-      initial_val = ConstantFP::get(*TheContext, APFloat(0.0));
+      initial_val = get_num(0.0);
     }
 
     Builder->CreateStore(initial_val, ptr);
+    DebugInfoInserter::insert_local_variable(this, variable_name, ptr);
 
     old_values.push_back(NamedValues[variable_name]);
     NamedValues[variable_name] = ptr;
@@ -0,0 +1,584 @@
+#include "consteval.h"
+#include "effects.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/MathExtras.h"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <map>
+
+namespace {
+
+// Every value the evaluator handles: floating point numbers, integers of up
+// to 64 bits (conditions, memo lookups) and addresses of local variables.
+union Scalar {
+  double F;
+  uint64_t I;
+  char *P;
+};
+
+class Evaluator {
+  struct Frame {
+    DenseMap<const Value *, Scalar> Values;
+    std::vector<std::unique_ptr<char[]>> Variables;
+  };
+
+  uint64_t Steps = 0;
+  unsigned Depth = 0;
+  std::chrono::steady_clock::time_point Deadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(CONST_EVAL_TIME_LIMIT_MS);
+  // Whatever the evaluator can run is pure, so results can be reused.
+  std::map<std::pair<const Function *, std::vector<double>>, double> Results;
+
+  bool step();
+  std::optional<double> run(const Function &F, const std::vector<double> &args);
+  std::optional<Scalar> execute(Frame &frame, const Instruction &I);
+  std::optional<Scalar> execute_call(Frame &frame, const CallInst &call);
+
+public:
+  std::optional<double> call(const Function &F,
+                             const std::vector<double> &args);
+};
+
+} // namespace
+
+// libm, and the LLVM intrinsics that stand for it
+static const std::map<std::string, double (*)(double)> UnaryMath = {
+    {"sin", [](double x) { return std::sin(x); }},
+    {"cos", [](double x) { return std::cos(x); }},
+    {"tan", [](double x) { return std::tan(x); }},
+    {"asin", [](double x) { return std::asin(x); }},
+    {"acos", [](double x) { return std::acos(x); }},
+    {"atan", [](double x) { return std::atan(x); }},
+    {"sinh", [](double x) { return std::sinh(x); }},
+    {"cosh", [](double x) { return std::cosh(x); }},
+    {"tanh", [](double x) { return std::tanh(x); }},
+    {"exp", [](double x) { return std::exp(x); }},
+    {"exp2", [](double x) { return std::exp2(x); }},
+    {"log", [](double x) { return std::log(x); }},
+    {"log2", [](double x) { return std::log2(x); }},
+    {"log10", [](double x) { return std::log10(x); }},
+    {"sqrt", [](double x) { return std::sqrt(x); }},
+    {"cbrt", [](double x) { return std::cbrt(x); }},
+    {"fabs", [](double x) { return std::fabs(x); }},
+    {"floor", [](double x) { return std::floor(x); }},
+    {"ceil", [](double x) { return std::ceil(x); }},
+    {"trunc", [](double x) { return std::trunc(x); }},
+    {"round", [](double x) { return std::round(x); }},
+    {"rint", [](double x) { return std::nearbyint(x); }},
+    {"nearbyint", [](double x) { return std::nearbyint(x); }},
+};
+
+static const std::map<std::string, double (*)(double, double)> BinaryMath = {
+    {"pow", [](double x, double y) { return std::pow(x, y); }},
+    {"atan2", [](double x, double y) { return std::atan2(x, y); }},
+    {"fmod", [](double x, double y) { return std::fmod(x, y); }},
+    {"hypot", [](double x, double y) { return std::hypot(x, y); }},
+    {"fmin", [](double x, double y) { return std::fmin(x, y); }},
+    {"fmax", [](double x, double y) { return std::fmax(x, y); }},
+    {"minnum", [](double x, double y) { return std::fmin(x, y); }},
+    {"maxnum", [](double x, double y) { return std::fmax(x, y); }},
+    {"copysign", [](double x, double y) { return std::copysign(x, y); }},
+};
+
+static std::optional<double> call_math(StringRef name,
+                                       const std::vector<double> &args) {
+  // Single-precision code calls the float variants; the caller rounds.
+  if (!UnaryMath.count(name.str()) && !BinaryMath.count(name.str()))
+    name.consume_back("f");
+  if (auto f = UnaryMath.find(name.str()); f != UnaryMath.end() &&
+                                           args.size() == 1)
+    return f->second(args[0]);
+  if (auto f = BinaryMath.find(name.str()); f != BinaryMath.end() &&
+                                            args.size() == 2)
+    return f->second(args[0], args[1]);
+  if ((name == "fma" || name == "fmuladd") && args.size() == 3)
+    return std::fma(args[0], args[1], args[2]);
+  return std::nullopt;
+}
+
+// Intrinsics that do not compute anything
+static bool is_annotation(Intrinsic::ID id) {
+  switch (id) {
+  case Intrinsic::dbg_declare:
+  case Intrinsic::dbg_value:
+  case Intrinsic::dbg_label:
+  case Intrinsic::lifetime_start:
+  case Intrinsic::lifetime_end:
+  case Intrinsic::assume:
+  case Intrinsic::experimental_noalias_scope_decl:
+  case Intrinsic::donothing:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static double round_to(const Type *type, double value) {
+  return type->isFloatTy() ? static_cast<float>(value) : value;
+}
+
+static bool compare(FCmpInst::Predicate predicate, double a, double b) {
+  bool unordered = std::isnan(a) || std::isnan(b);
+  switch (predicate) {
+  case FCmpInst::FCMP_FALSE:
+    return false;
+  case FCmpInst::FCMP_OEQ:
+    return !unordered && a == b;
+  case FCmpInst::FCMP_OGT:
+    return !unordered && a > b;
+  case FCmpInst::FCMP_OGE:
+    return !unordered && a >= b;
+  case FCmpInst::FCMP_OLT:
+    return !unordered && a < b;
+  case FCmpInst::FCMP_OLE:
+    return !unordered && a <= b;
+  case FCmpInst::FCMP_ONE:
+    return !unordered && a != b;
+  case FCmpInst::FCMP_ORD:
+    return !unordered;
+  case FCmpInst::FCMP_UNO:
+    return unordered;
+  case FCmpInst::FCMP_UEQ:
+    return unordered || a == b;
+  case FCmpInst::FCMP_UGT:
+    return unordered || a > b;
+  case FCmpInst::FCMP_UGE:
+    return unordered || a >= b;
+  case FCmpInst::FCMP_ULT:
+    return unordered || a < b;
+  case FCmpInst::FCMP_ULE:
+    return unordered || a <= b;
+  case FCmpInst::FCMP_UNE:
+    return unordered || a != b;
+  default:
+    return true;
+  }
+}
+
+static std::optional<Scalar> read(const char *address, Type *type) {
+  Scalar value{};
+  if (type->isDoubleTy()) {
+    std::memcpy(&value.F, address, sizeof(double));
+  } else if (type->isFloatTy()) {
+    float single;
+    std::memcpy(&single, address, sizeof(float));
+    value.F = single;
+  } else if (type->isIntegerTy() && type->getIntegerBitWidth() <= 64) {
+    std::memcpy(&value.I, address, (type->getIntegerBitWidth() + 7) / 8);
+  } else if (type->isPointerTy()) {
+    std::memcpy(&value.P, address, sizeof(char *));
+  } else {
+    return std::nullopt;
+  }
+  return value;
+}
+
+static bool write(char *address, Scalar value, Type *type) {
+  if (type->isDoubleTy()) {
+    std::memcpy(address, &value.F, sizeof(double));
+  } else if (type->isFloatTy()) {
+    float single = value.F;
+    std::memcpy(address, &single, sizeof(float));
+  } else if (type->isIntegerTy() && type->getIntegerBitWidth() <= 64) {
+    std::memcpy(address, &value.I, (type->getIntegerBitWidth() + 7) / 8);
+  } else if (type->isPointerTy()) {
+    std::memcpy(address, &value.P, sizeof(char *));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static std::optional<Scalar> constant(const Value *V) {
+  Scalar value{};
+  if (auto *C = dyn_cast<ConstantFP>(V))
+    value.F = C->getValueAPF().convertToDouble();
+  else if (auto *C = dyn_cast<ConstantInt>(V); C && C->getBitWidth() <= 64)
+    value.I = C->getZExtValue();
+  else if (isa<ConstantPointerNull>(V) || isa<GlobalValue>(V))
+    value.P = nullptr; // only passed to the memo runtime, never dereferenced
+  else if (!isa<UndefValue>(V))
+    return std::nullopt;
+  return value;
+}
+
+bool Evaluator::step() {
+  if (++Steps > CONST_EVAL_STEP_LIMIT)
+    return false;
+  return Steps % 4096 || std::chrono::steady_clock::now() < Deadline;
+}
+
+std::optional<double> Evaluator::call(const Function &F,
+                                      const std::vector<double> &args) {
+  if (F.isDeclaration())
+    return call_math(F.getName(), args);
+
+  auto key = std::make_pair(&F, args);
+  if (auto result = Results.find(key); result != Results.end())
+    return result->second;
+  if (Depth >= CONST_EVAL_MAX_DEPTH)
+    return std::nullopt;
+
+  ++Depth;
+  auto result = run(F, args);
+  --Depth;
+  if (result)
+    Results[key] = *result;
+  return result;
+}
+
+std::optional<double> Evaluator::run(const Function &F,
+                                     const std::vector<double> &args) {
+  if (F.arg_size() != args.size() ||
+      !F.getReturnType()->isFloatingPointTy())
+    return std::nullopt;
+
+  Frame frame;
+  for (auto [arg, value] : zip(F.args(), args)) {
+    if (!arg.getType()->isFloatingPointTy())
+      return std::nullopt;
+    frame.Values[&arg].F = round_to(arg.getType(), value);
+  }
+
+  auto operand = [&](const Value *V) -> std::optional<Scalar> {
+    if (auto value = frame.Values.find(V); value != frame.Values.end())
+      return value->second;
+    return constant(V);
+  };
+
+  const BasicBlock *previous = nullptr;
+  const BasicBlock *block = &F.getEntryBlock();
+  while (true) {
+    // The PHIs of a block take their values at once.
+    SmallVector<std::pair<const PHINode *, Scalar>, 4> phis;
+    for (auto &phi : block->phis()) {
+      auto value = operand(phi.getIncomingValueForBlock(previous));
+      if (!value)
+        return std::nullopt;
+      phis.emplace_back(&phi, *value);
+    }
+    for (auto [phi, value] : phis)
+      frame.Values[phi] = value;
+
+    const BasicBlock *next = nullptr;
+    for (auto &I : *block) {
+      if (isa<PHINode>(I))
+        continue;
+      if (!step())
+        return std::nullopt;
+
+      if (auto *ret = dyn_cast<ReturnInst>(&I)) {
+        if (!ret->getReturnValue())
+          return std::nullopt;
+        auto value = operand(ret->getReturnValue());
+        if (!value)
+          return std::nullopt;
+        return value->F;
+      }
+      if (auto *branch = dyn_cast<BranchInst>(&I)) {
+        next = branch->getSuccessor(0);
+        if (branch->isConditional()) {
+          auto condition = operand(branch->getCondition());
+          if (!condition)
+            return std::nullopt;
+          next = branch->getSuccessor(condition->I & 1 ? 0 : 1);
+        }
+        break;
+      }
+
+      auto value = execute(frame, I);
+      if (!value)
+        return std::nullopt;
+      frame.Values[&I] = *value;
+    }
+
+    if (!next)
+      return std::nullopt;
+    previous = block;
+    block = next;
+  }
+}
+
+std::optional<Scalar> Evaluator::execute(Frame &frame, const Instruction &I) {
+  auto &DL = I.getModule()->getDataLayout();
+  auto *type = I.getType();
+  auto operand = [&](unsigned index) -> std::optional<Scalar> {
+    auto *V = I.getOperand(index);
+    if (auto value = frame.Values.find(V); value != frame.Values.end())
+      return value->second;
+    return constant(V);
+  };
+
+  if (auto *alloca = dyn_cast<AllocaInst>(&I)) {
+    auto size = alloca->getAllocationSize(DL);
+    if (!size || size->isScalable())
+      return std::nullopt;
+    auto &variable = frame.Variables.emplace_back(
+        std::make_unique<char[]>(size->getFixedValue()));
+    return Scalar{.P = variable.get()};
+  }
+
+  if (auto *load = dyn_cast<LoadInst>(&I)) {
+    auto address = operand(load->getPointerOperandIndex());
+    if (!address || !address->P)
+      return std::nullopt;
+    return read(address->P, type);
+  }
+
+  if (auto *store = dyn_cast<StoreInst>(&I)) {
+    auto address = operand(store->getPointerOperandIndex());
+    auto value = operand(0);
+    if (!address || !address->P || !value ||
+        !write(address->P, *value, store->getValueOperand()->getType()))
+      return std::nullopt;
+    return Scalar{};
+  }
+
+  if (auto *gep = dyn_cast<GetElementPtrInst>(&I)) {
+    APInt offset(DL.getIndexTypeSizeInBits(gep->getType()), 0);
+    auto base = operand(0);
+    if (!base || !base->P || !gep->accumulateConstantOffset(DL, offset))
+      return std::nullopt;
+    return Scalar{.P = base->P + offset.getSExtValue()};
+  }
+
+  if (I.getOpcode() == Instruction::FNeg) {
+    auto value = operand(0);
+    if (!value)
+      return std::nullopt;
+    return Scalar{.F = -value->F};
+  }
+
+  if (auto *binary = dyn_cast<BinaryOperator>(&I)) {
+    auto L = operand(0);
+    auto R = operand(1);
+    if (!L || !R)
+      return std::nullopt;
+
+    if (type->isFloatingPointTy()) {
+      double result;
+      switch (binary->getOpcode()) {
+      case Instruction::FAdd:
+        result = L->F + R->F;
+        break;
+      case Instruction::FSub:
+        result = L->F - R->F;
+        break;
+      case Instruction::FMul:
+        result = L->F * R->F;
+        break;
+      case Instruction::FDiv:
+        result = L->F / R->F;
+        break;
+      case Instruction::FRem:
+        result = std::fmod(L->F, R->F);
+        break;
+      default:
+        return std::nullopt;
+      }
+      return Scalar{.F = round_to(type, result)};
+    }
+
+    if (!type->isIntegerTy() || type->getIntegerBitWidth() > 64)
+      return std::nullopt;
+    unsigned bits = type->getIntegerBitWidth();
+    APInt a(bits, L->I), b(bits, R->I), result;
+    switch (binary->getOpcode()) {
+    case Instruction::Add:
+      result = a + b;
+      break;
+    case Instruction::Sub:
+      result = a - b;
+      break;
+    case Instruction::Mul:
+      result = a * b;
+      break;
+    case Instruction::And:
+      result = a & b;
+      break;
+    case Instruction::Or:
+      result = a | b;
+      break;
+    case Instruction::Xor:
+      result = a ^ b;
+      break;
+    case Instruction::Shl:
+    case Instruction::LShr:
+    case Instruction::AShr:
+      if (b.uge(bits))
+        return std::nullopt;
+      result = binary->getOpcode() == Instruction::Shl    ? a.shl(b)
+               : binary->getOpcode() == Instruction::LShr ? a.lshr(b)
+                                                          : a.ashr(b);
+      break;
+    case Instruction::UDiv:
+    case Instruction::URem:
+      if (b.isZero())
+        return std::nullopt;
+      result = binary->getOpcode() == Instruction::UDiv ? a.udiv(b) : a.urem(b);
+      break;
+    case Instruction::SDiv:
+    case Instruction::SRem:
+      if (b.isZero() || (a.isMinSignedValue() && b.isAllOnes()))
+        return std::nullopt;
+      result = binary->getOpcode() == Instruction::SDiv ? a.sdiv(b) : a.srem(b);
+      break;
+    default:
+      return std::nullopt;
+    }
+    return Scalar{.I = result.getZExtValue()};
+  }
+
+  if (auto *cmp = dyn_cast<FCmpInst>(&I)) {
+    auto L = operand(0);
+    auto R = operand(1);
+    if (!L || !R)
+      return std::nullopt;
+    return Scalar{.I = compare(cmp->getPredicate(), L->F, R->F)};
+  }
+
+  if (auto *cmp = dyn_cast<ICmpInst>(&I)) {
+    auto *operand_type = cmp->getOperand(0)->getType();
+    auto L = operand(0);
+    auto R = operand(1);
+    if (!L || !R || !operand_type->isIntegerTy() ||
+        operand_type->getIntegerBitWidth() > 64)
+      return std::nullopt;
+    unsigned bits = operand_type->getIntegerBitWidth();
+    return Scalar{.I = ICmpInst::compare(APInt(bits, L->I), APInt(bits, R->I),
+                                         cmp->getPredicate())};
+  }
+
+  if (auto *select = dyn_cast<SelectInst>(&I)) {
+    auto condition = operand(0);
+    if (!condition)
+      return std::nullopt;
+    return operand(condition->I & 1 ? 1 : 2);
+  }
+
+  if (auto *cast = dyn_cast<CastInst>(&I)) {
+    auto value = operand(0);
+    auto *source = cast->getSrcTy();
+    if (!value || (source->isIntegerTy() && source->getIntegerBitWidth() > 64) ||
+        (type->isIntegerTy() && type->getIntegerBitWidth() > 64))
+      return std::nullopt;
+    unsigned from = source->getScalarSizeInBits();
+    unsigned to = type->getScalarSizeInBits();
+    auto truncate = [&](uint64_t bits) {
+      return to >= 64 ? bits : bits & ((uint64_t(1) << to) - 1);
+    };
+
+    switch (cast->getOpcode()) {
+    case Instruction::UIToFP:
+      return Scalar{.F = round_to(type, static_cast<double>(value->I))};
+    case Instruction::SIToFP:
+      return Scalar{.F = round_to(
+                        type, static_cast<double>(SignExtend64(value->I, from)))};
+    case Instruction::FPToSI:
+    case Instruction::FPToUI: {
+      // Out of range conversions are poison.
+      double limit = std::ldexp(1.0, to);
+      bool is_signed = cast->getOpcode() == Instruction::FPToSI;
+      double low = is_signed ? -limit / 2 : 0;
+      double high = is_signed ? limit / 2 : limit;
+      if (!(value->F >= low && value->F < high))
+        return std::nullopt;
+      auto integer = is_signed ? static_cast<uint64_t>(
+                                     static_cast<int64_t>(value->F))
+                               : static_cast<uint64_t>(value->F);
+      return Scalar{.I = truncate(integer)};
+    }
+    case Instruction::ZExt:
+      return value;
+    case Instruction::SExt:
+      return Scalar{.I = truncate(SignExtend64(value->I, from))};
+    case Instruction::Trunc:
+      return Scalar{.I = truncate(value->I)};
+    case Instruction::FPTrunc:
+    case Instruction::FPExt:
+      return Scalar{.F = round_to(type, value->F)};
+    default:
+      return std::nullopt;
+    }
+  }
+
+  if (auto *call = dyn_cast<CallInst>(&I))
+    return execute_call(frame, *call);
+
+  return std::nullopt;
+}
+
+std::optional<Scalar> Evaluator::execute_call(Frame &frame,
+                                              const CallInst &call) {
+  auto *callee = call.getCalledFunction();
+  if (!callee)
+    return std::nullopt;
+  if (callee->isIntrinsic() && is_annotation(callee->getIntrinsicID()))
+    return Scalar{};
+  // A memo function behaves like any other; Results caches it already.
+  if (callee->getName() == "kl_memo_lookup")
+    return Scalar{.I = 0};
+  if (callee->getName() == "kl_memo_store")
+    return Scalar{};
+
+  std::vector<double> args;
+  for (auto &arg : call.args()) {
+    if (!arg->getType()->isFloatingPointTy())
+      return std::nullopt;
+    if (auto value = frame.Values.find(arg); value != frame.Values.end())
+      args.push_back(value->second.F);
+    else if (auto value = constant(arg))
+      args.push_back(value->F);
+    else
+      return std::nullopt;
+  }
+
+  std::optional<double> result;
+  if (callee->isIntrinsic())
+    result = call_math(
+        Intrinsic::getBaseName(callee->getIntrinsicID()).drop_front(5), args);
+  else
+    result = this->call(*callee, args);
+  if (!result)
+    return std::nullopt;
+  return Scalar{.F = round_to(call.getType(), *result)};
+}
+
+std::optional<double> evaluate_call(const Function &F,
+                                    const std::vector<double> &args) {
+  return Evaluator().call(F, args);
+}
+
+bool fold_constant_calls(Function &F) {
+  bool changed = false;
+  for (auto &I : make_early_inc_range(instructions(F))) {
+    auto *call = dyn_cast<CallInst>(&I);
+    if (!call)
+      continue;
+    // LLVM folds calls to libm itself. Memo functions are folded too; their
+    // cache only saves work the result replaces.
+    auto *callee = call->getCalledFunction();
+    if (!callee || callee->isDeclaration() ||
+        !computes_from_arguments(*callee) ||
+        !call->getType()->isFloatingPointTy())
+      continue;
+
+    std::vector<double> args;
+    for (auto &arg : call->args())
+      if (auto *C = dyn_cast<ConstantFP>(arg))
+        args.push_back(C->getValueAPF().convertToDouble());
+    if (args.size() != call->arg_size())
+      continue;
+
+    if (auto value = evaluate_call(*callee, args)) {
+      call->replaceAllUsesWith(ConstantFP::get(call->getType(), *value));
+      call->eraseFromParent();
+      changed = true;
+    }
+  }
+  return changed;
+}
@@ -6,12 +6,14 @@
 
 DebugInfo KSDbgInfo;
 
-DIType *DebugInfo::get_double_type() {
-  if (DblTy)
-    return DblTy;
-
-  DblTy = DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
-  return DblTy;
+DIType *DebugInfo::get_num_type() {
+  if (NumTy)
+    return NumTy;
+
+  NumTy = SINGLE_PRECISION
+              ? DBuilder->createBasicType("float", 32, dwarf::DW_ATE_float)
+              : DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+  return NumTy;
 }
 
 DIType *DebugInfo::get_int_type() {
@@ -41,11 +43,11 @@ void DebugInfo::emit_location(ExprAST *ast) {
 DISubroutineType *create_function_type(unsigned args_num, bool is_main) {
   SmallVector<Metadata *, 8> EltTys;
   if (!is_main) {
-    auto *DblTy = KSDbgInfo.get_double_type();
+    auto *NumTy = KSDbgInfo.get_num_type();
 
-    EltTys.push_back(DblTy);
+    EltTys.push_back(NumTy);
     for (unsigned i = 0, e = args_num; i != e; ++i)
-      EltTys.push_back(DblTy);
+      EltTys.push_back(NumTy);
 
     return DBuilder->createSubroutineType(
         DBuilder->getOrCreateTypeArray(EltTys));
@@ -89,7 +91,7 @@ void DebugInfoInserter::insert_function_parameter(unsigned line_no,
   static unsigned arg_idx = 0;
   DILocalVariable *debug_descriptor = DBuilder->createParameterVariable(
       FDI.sp, arg.getName(), ++arg_idx, FDI.unit, line_no,
-      KSDbgInfo.get_double_type(), true);
+      KSDbgInfo.get_num_type(), true);
 
   DBuilder->insertDeclare(
       arg_alloca, debug_descriptor, DBuilder->createExpression(),
@@ -97,6 +99,21 @@ void DebugInfoInserter::insert_function_parameter(unsigned line_no,
       Builder->GetInsertBlock());
 }
 
+void DebugInfoInserter::insert_local_variable(ExprAST *ast, StringRef name,
+                                              AllocaInst *alloca) {
+  if (!DEBUG || KSDbgInfo.LexicalBlocks.empty())
+    return;
+
+  auto *scope = KSDbgInfo.LexicalBlocks.back();
+  auto *variable = DBuilder->createAutoVariable(
+      scope, name, scope->getFile(), ast->get_line(),
+      KSDbgInfo.get_num_type(), true);
+  DBuilder->insertDeclare(alloca, variable, DBuilder->createExpression(),
+                          DILocation::get(scope->getContext(), ast->get_line(),
+                                          ast->get_col(), scope),
+                          Builder->GetInsertBlock());
+}
+
 void DebugInfoInserter::reset_scope() {
   if (DEBUG)
     KSDbgInfo.LexicalBlocks.pop_back();
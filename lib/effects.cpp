@@ -0,0 +1,198 @@
+#include "effects.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/InstIterator.h"
+#include <set>
+
+static constexpr FunctionEffects PURE = {true, true, true, true};
+static constexpr FunctionEffects IMPURE = {false, true, true, false};
+
+// libm. Kl++ never reads errno, so the math functions count as pure.
+static const std::set<std::string> MathFunctions = {
+    "sin",   "cos",   "tan",   "asin",  "acos", "atan",  "atan2",
+    "sinh",  "cosh",  "tanh",  "exp",   "exp2", "log",   "log2",
+    "log10", "pow",   "sqrt",  "cbrt",  "fabs", "floor", "ceil",
+    "round", "trunc", "fmod",  "hypot", "fmin", "fmax",  "copysign",
+    "fma",
+};
+
+// Math functions with an LLVM intrinsic, and their number of arguments.
+// `min` and `max` are not in libm; they only exist as intrinsics.
+static const std::map<std::string, std::pair<Intrinsic::ID, size_t>>
+    MathIntrinsics = {
+        {"sqrt", {Intrinsic::sqrt, 1}},   {"fabs", {Intrinsic::fabs, 1}},
+        {"floor", {Intrinsic::floor, 1}}, {"ceil", {Intrinsic::ceil, 1}},
+        {"trunc", {Intrinsic::trunc, 1}}, {"round", {Intrinsic::round, 1}},
+        {"sin", {Intrinsic::sin, 1}},     {"cos", {Intrinsic::cos, 1}},
+        {"exp", {Intrinsic::exp, 1}},     {"exp2", {Intrinsic::exp2, 1}},
+        {"log", {Intrinsic::log, 1}},     {"log2", {Intrinsic::log2, 1}},
+        {"log10", {Intrinsic::log10, 1}}, {"pow", {Intrinsic::pow, 2}},
+        {"fmin", {Intrinsic::minnum, 2}}, {"fmax", {Intrinsic::maxnum, 2}},
+        {"min", {Intrinsic::minnum, 2}},  {"max", {Intrinsic::maxnum, 2}},
+        {"copysign", {Intrinsic::copysign, 2}},
+        {"fma", {Intrinsic::fma, 3}},
+};
+
+// Externs the runtime and libm provide, the latter also as the float variants
+// that single-precision code calls. The operators of lib/std/core.kl come from
+// their `extern pure` declarations in lib/core.hkl, or from inference where
+// their definitions are compiled.
+static std::map<std::string, FunctionEffects> KnownEffects = [] {
+  std::map<std::string, FunctionEffects> effects = {
+      {"putchard", IMPURE}, {"print", IMPURE},    {"printd", IMPURE},
+      {"flush", IMPURE},    {"nargs", IMPURE},    {"arg", IMPURE},
+      {"memostats", IMPURE}, {"memolimit", IMPURE}, {"mapfile", IMPURE},
+      {"mapdata", IMPURE},  {"readnum", IMPURE},  {"eof", IMPURE},
+  };
+  for (auto &name : MathFunctions) {
+    effects[name] = PURE;
+    effects[name + "f"] = PURE;
+  }
+  return effects;
+}();
+
+bool is_math_function(const std::string &name) {
+  return MathFunctions.count(name);
+}
+
+Intrinsic::ID get_math_intrinsic(const std::string &name, size_t arg_count) {
+  auto intrinsic = MathIntrinsics.find(name);
+  if (intrinsic == MathIntrinsics.end() ||
+      intrinsic->second.second != arg_count)
+    return Intrinsic::not_intrinsic;
+  return intrinsic->second.first;
+}
+
+// Only set_effects() gives functions memory(inaccessiblemem), for WritesCache.
+bool computes_from_arguments(const Function &F) {
+  return F.onlyAccessesInaccessibleMemory();
+}
+
+std::optional<FunctionEffects> known_effects(const std::string &name) {
+  auto effects = KnownEffects.find(name);
+  if (effects == KnownEffects.end())
+    return std::nullopt;
+  return effects->second;
+}
+
+// Speculating a call is left to what the definition itself allows.
+void declare_pure(const std::string &name) {
+  KnownEffects[name] = {true, true, true, false};
+}
+
+void forget_effects(const std::string &name) { KnownEffects.erase(name); }
+
+static void set_effects(Function &F, const FunctionEffects &effects) {
+  F.removeFnAttr(Attribute::Memory);
+  F.removeFnAttr(Attribute::NoUnwind);
+  F.removeFnAttr(Attribute::WillReturn);
+  F.removeFnAttr(Attribute::Speculatable);
+
+  if (effects.ReadNone && effects.WritesCache)
+    F.setOnlyAccessesInaccessibleMemory();
+  else if (effects.ReadNone)
+    F.setDoesNotAccessMemory();
+  if (effects.NoUnwind)
+    F.setDoesNotThrow();
+  if (effects.WillReturn)
+    F.setWillReturn();
+  if (effects.Speculatable)
+    F.setSpeculatable();
+}
+
+void apply_known_effects(Function &F) {
+  if (auto effects = known_effects(F.getName().str()))
+    set_effects(F, *effects);
+}
+
+// Effects of F alone. Calls to functions of `scc`, which includes F, add
+// nothing but the possibility of not returning.
+static FunctionEffects body_effects(const Function &F,
+                                    const SmallPtrSetImpl<Function *> &scc) {
+  FunctionEffects effects = PURE;
+
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 4> backedges;
+  FindFunctionBackedges(F, backedges);
+  if (!backedges.empty())
+    effects.WillReturn = false; // `for` conditions are arbitrary
+
+  for (auto &I : instructions(F)) {
+    if (auto *call = dyn_cast<CallBase>(&I)) {
+      auto *callee = call->getCalledFunction();
+      if (!callee) {
+        effects = FunctionEffects();
+      } else if (callee->getName().starts_with("kl_memo_")) {
+        // The cache of a memo function is invisible to Kl++ code, but the
+        // calls that fill it must not be removed.
+        effects.WritesCache = true;
+      } else if (scc.contains(callee)) {
+        effects.WillReturn = false;
+      } else {
+        bool pure = computes_from_arguments(*callee);
+        effects.ReadNone &= pure;
+        effects.WritesCache |= pure && !callee->doesNotAccessMemory();
+        effects.NoUnwind &= callee->doesNotThrow();
+        effects.WillReturn &= callee->willReturn();
+        effects.Speculatable &= callee->isSpeculatable();
+      }
+    } else if (I.mayReadOrWriteMemory()) {
+      // Variables live in allocas until mem2reg has run.
+      auto *pointer = getLoadStorePointerOperand(&I);
+      if (!pointer || !isa<AllocaInst>(getUnderlyingObject(pointer)))
+        effects.ReadNone = false;
+    }
+  }
+
+  effects.Speculatable &= effects.ReadNone && effects.NoUnwind &&
+                          effects.WillReturn && !effects.WritesCache;
+  return effects;
+}
+
+// Callers compiled against the effects of a definition are only recompiled
+// when it is redefined if the JIT keeps track of them (see inliner.h).
+static void remember_effects(const Function &F,
+                             const FunctionEffects &effects) {
+  if (F.getName().starts_with(ANON_FUNCTION) || (TheJIT && !JIT_INLINING))
+    return;
+  KnownEffects[F.getName().str()] = effects;
+}
+
+FunctionEffects analyze_effects(const Function &F) {
+  SmallPtrSet<Function *, 1> scc;
+  scc.insert(const_cast<Function *>(&F));
+  return body_effects(F, scc);
+}
+
+void infer_effects(Function &F) {
+  auto effects = analyze_effects(F);
+  set_effects(F, effects);
+  remember_effects(F, effects);
+}
+
+void infer_effects(Module &M) {
+  CallGraph CG(M);
+  for (auto I = scc_begin(&CG); !I.isAtEnd(); ++I) {
+    SmallPtrSet<Function *, 4> scc;
+    for (auto *node : *I)
+      if (auto *F = node->getFunction(); F && !F->isDeclaration())
+        scc.insert(F);
+    if (scc.empty())
+      continue;
+
+    FunctionEffects effects = PURE;
+    for (auto *F : scc) {
+      auto own = body_effects(*F, scc);
+      effects.ReadNone &= own.ReadNone;
+      effects.NoUnwind &= own.NoUnwind;
+      effects.WillReturn &= own.WillReturn;
+      effects.Speculatable &= own.Speculatable;
+      effects.WritesCache |= own.WritesCache;
+    }
+    for (auto *F : scc) {
+      set_effects(*F, effects);
+      remember_effects(*F, effects);
+    }
+  }
+}
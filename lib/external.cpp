@@ -1,23 +1,862 @@
+#include "external.h"
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #ifdef _WIN32
 #define DLLEXPORT __declspec(dllexport)
 #else
 #define DLLEXPORT
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
 
-/// putchard - putchar that takes a double and returns 0.
-extern "C" DLLEXPORT double putchard(double X) {
-  fputc((char)X, stderr);
+// The number type of the Kl++ code linked against this runtime. The object is
+// built once per precision; the REPL links the double one and uses its
+// kl_f32_* entry points for `--precision=single`.
+#ifdef KL_SINGLE_PRECISION
+using kl_num = float;
+#else
+using kl_num = double;
+#endif
+
+static int kl_argc;
+static char **kl_argv;
+
+/// kl_set_args - make the program arguments visible to `nargs` and `arg`.
+/// argv[0] is the program name.
+extern "C" DLLEXPORT void kl_set_args(int argc, char **argv) {
+  kl_argc = argc;
+  kl_argv = argv;
+}
+
+#if defined(__GNUC__) && !defined(_WIN32)
+// Both glibc and dyld pass the arguments of main to initializers, so AOT
+// binaries get them without a special `main` signature. The JIT overrides
+// them with kl_set_args.
+__attribute__((constructor)) static void kl_capture_args(int argc,
+                                                         char **argv) {
+  kl_set_args(argc, argv);
+}
+#endif
+
+// Output
+//
+// putchard, print and printd append to a buffer, which is written out when it
+// is full, on flush(), when the program exits and, in the REPL, after every
+// top-level expression. It goes to stderr, or to stdout with KL_OUTPUT=stdout.
+// parfor bodies call the builtins from several threads at once, so the buffer
+// is locked and a line is never interleaved with another.
+
+namespace {
+class OutputBuffer {
+  char Data[1 << 16];
+  size_t Size = 0;
+  FILE *Stream;
+
+public:
+  std::mutex Mutex;
+
+  OutputBuffer() {
+    auto *output = std::getenv("KL_OUTPUT");
+    Stream = output && std::strcmp(output, "stdout") == 0 ? stdout : stderr;
+  }
+  ~OutputBuffer() { flush(); }
+
+  // Callers hold Mutex.
+  void flush() {
+    if (Size)
+      fwrite(Data, 1, Size, Stream);
+    Size = 0;
+    fflush(Stream);
+  }
+
+  void write(const char *text, size_t length) {
+    if (Size + length > sizeof(Data)) {
+      flush();
+      if (length > sizeof(Data)) {
+        fwrite(text, 1, length, Stream);
+        return;
+      }
+    }
+    std::memcpy(Data + Size, text, length);
+    Size += length;
+  }
+};
+} // namespace
+
+static OutputBuffer Output;
+
+/// putchard - putchar that takes a number and returns 0.
+template <typename Num> static Num putchard_(Num X) {
+  char c = static_cast<char>(X);
+  std::lock_guard<std::mutex> lock(Output.Mutex);
+  Output.write(&c, 1);
+  return 0;
+}
+
+// "\r%lf\n" and "\r%d\n", formatted without printf
+template <typename Num> static Num print_(Num X) {
+  // The longest fixed-point double has 309 digits before the point.
+  char text[330] = {'\r'};
+  auto end = std::to_chars(text + 1, text + sizeof(text) - 1,
+                           static_cast<double>(X), std::chars_format::fixed, 6)
+                 .ptr;
+  *end++ = '\n';
+  std::lock_guard<std::mutex> lock(Output.Mutex);
+  Output.write(text, end - text);
   return 0;
 }
 
-extern "C" DLLEXPORT double print(double X) {
-  fprintf(stderr, "\r%lf\n", X);
+template <typename Num> static Num printd_(Num X) {
+  char text[16] = {'\r'};
+  auto end =
+      std::to_chars(text + 1, text + sizeof(text) - 1, static_cast<int>(X)).ptr;
+  *end++ = '\n';
+  std::lock_guard<std::mutex> lock(Output.Mutex);
+  Output.write(text, end - text);
   return 0;
 }
 
-extern "C" DLLEXPORT double printd(double X) {
-  fprintf(stderr, "\r%d\n", static_cast<int>(X));
+/// flush - write out what putchard, print and printd buffered.
+template <typename Num> static Num flush_() {
+  std::lock_guard<std::mutex> lock(Output.Mutex);
+  Output.flush();
   return 0;
 }
+
+extern "C" DLLEXPORT void kl_flush() { flush_<kl_num>(); }
+
+/// nargs - number of arguments passed to the program.
+template <typename Num> static Num nargs_() {
+  return kl_argc > 0 ? kl_argc - 1 : 0;
+}
+
+/// arg - the i-th program argument (starting at 0) read as a number, or 0 if
+/// there is no such argument.
+template <typename Num> static Num arg_(Num X) {
+  int i = static_cast<int>(X) + 1;
+  if (X < 0 || i >= kl_argc)
+    return 0;
+  return std::strtod(kl_argv[i], nullptr);
+}
+
+// memo def
+//
+// Every memo function has a cache keyed by the bits of its arguments. The
+// generated code keeps a pointer to it in a global slot and creates it on the
+// first call; a redefinition gets a new slot and so a new, empty cache. Tier 0
+// and tier 1 code and specializations share the slot. The REPL releases the
+// caches of a definition when it removes its code, as nothing can use them
+// any more. A full cache drops its least recently used entry.
+
+namespace {
+struct MemoCache {
+  std::string Name;
+  std::mutex Mutex;
+  // Most recently used first; Entries points into it.
+  std::list<std::pair<std::string, double>> Order;
+  std::unordered_map<std::string_view,
+                     std::list<std::pair<std::string, double>>::iterator>
+      Entries;
+  uint64_t Hits = 0;
+  uint64_t Misses = 0;
+};
+} // namespace
+
+static std::mutex MemoCachesMutex;
+static std::vector<std::unique_ptr<MemoCache>> MemoCaches;
+
+// Entries per function. Can be set through KL_MEMO_LIMIT and memolimit().
+static std::atomic<size_t> MemoLimit = [] {
+  auto *limit = std::getenv("KL_MEMO_LIMIT");
+  return limit ? std::strtoull(limit, nullptr, 10) : size_t(1) << 20;
+}();
+
+static MemoCache &get_memo_cache(void **slot, const char *name) {
+  std::atomic_ref<void *> cache(*slot);
+  if (auto *existing = cache.load(std::memory_order_acquire))
+    return *static_cast<MemoCache *>(existing);
+
+  std::lock_guard<std::mutex> lock(MemoCachesMutex);
+  if (auto *existing = cache.load(std::memory_order_relaxed))
+    return *static_cast<MemoCache *>(existing);
+  auto &entry = MemoCaches.emplace_back(std::make_unique<MemoCache>());
+  entry->Name = name;
+  cache.store(entry.get(), std::memory_order_release);
+  return *entry;
+}
+
+template <typename Num>
+static std::string memo_key(const Num *args, int n) {
+  return std::string(reinterpret_cast<const char *>(args), n * sizeof(Num));
+}
+
+/// kl_memo_lookup - fetch the cached result of a memo function into `result`;
+/// returns whether there was one.
+template <typename Num>
+static int kl_memo_lookup_(void **slot, const char *name, const Num *args,
+                           int n, Num *result) {
+  auto &cache = get_memo_cache(slot, name);
+  std::lock_guard<std::mutex> lock(cache.Mutex);
+  auto key = memo_key(args, n);
+  auto entry = cache.Entries.find(key);
+  if (entry == cache.Entries.end()) {
+    ++cache.Misses;
+    return 0;
+  }
+  ++cache.Hits;
+  cache.Order.splice(cache.Order.begin(), cache.Order, entry->second);
+  *result = entry->second->second;
+  return 1;
+}
+
+/// kl_memo_store - remember the result of a memo function.
+template <typename Num>
+static void kl_memo_store_(void **slot, const Num *args, int n, Num result) {
+  auto &cache = *static_cast<MemoCache *>(*slot);
+  std::lock_guard<std::mutex> lock(cache.Mutex);
+  // Another thread may have computed the same call meanwhile.
+  auto key = memo_key(args, n);
+  if (cache.Entries.count(key))
+    return;
+  while (!cache.Order.empty() && cache.Entries.size() >= MemoLimit) {
+    cache.Entries.erase(cache.Order.back().first);
+    cache.Order.pop_back();
+  }
+  cache.Order.emplace_front(std::move(key), result);
+  cache.Entries.emplace(cache.Order.front().first, cache.Order.begin());
+}
+
+extern "C" DLLEXPORT void kl_memo_release(const char *name) {
+  std::lock_guard<std::mutex> lock(MemoCachesMutex);
+  std::erase_if(MemoCaches,
+                [&](auto &cache) { return cache->Name == name; });
+}
+
+/// memostats - print the hits, misses and size of the cache of every memo
+/// function, the latest definition's for a redefined one.
+template <typename Num> static Num memostats_() {
+  std::lock_guard<std::mutex> lock(MemoCachesMutex);
+  std::map<std::string, MemoCache *> latest;
+  for (auto &cache : MemoCaches)
+    latest[cache->Name] = cache.get();
+
+  std::lock_guard<std::mutex> output_lock(Output.Mutex);
+  Output.flush();
+  for (auto &[name, cache] : latest) {
+    std::lock_guard<std::mutex> cache_lock(cache->Mutex);
+    fprintf(stderr, "\r%s: %llu hits, %llu misses, %zu entries\n",
+            name.c_str(), static_cast<unsigned long long>(cache->Hits),
+            static_cast<unsigned long long>(cache->Misses),
+            cache->Entries.size());
+  }
+  return 0;
+}
+
+/// memolimit - set the number of entries a memo cache may hold before it
+/// drops old ones; returns the previous limit.
+template <typename Num> static Num memolimit_(Num X) {
+  return static_cast<Num>(
+      MemoLimit.exchange(X < 1 ? 1 : static_cast<size_t>(X)));
+}
+
+// arrays
+
+extern "C" DLLEXPORT KlArray *kl_arrays[KL_ARRAY_PAGES];
+KlArray *kl_arrays[KL_ARRAY_PAGES];
+
+static KlArray EmptyPage[KL_ARRAY_PAGE_SIZE];
+static KlArray FirstPage[KL_ARRAY_PAGE_SIZE];
+static const bool ArrayPagesReady = [] {
+  std::fill(std::begin(kl_arrays), std::end(kl_arrays), &EmptyPage[0]);
+  kl_arrays[0] = FirstPage;
+  return true;
+}();
+
+static std::mutex ArraysMutex;
+static std::vector<int64_t> FreeArrays;
+static int64_t NextArray = 1;
+// handle -> size of the mapping, for the arrays of mapfile and mapdata
+static std::unordered_map<int64_t, size_t> MappedArrays;
+
+static KlArray &array_entry(int64_t handle) {
+  return kl_arrays[handle >> KL_ARRAY_PAGE_BITS]
+                  [handle & (KL_ARRAY_PAGE_SIZE - 1)];
+}
+
+// Returns the new handle, or 0 if there is no room.
+static int64_t add_array(void *data, int64_t length) {
+  std::lock_guard<std::mutex> lock(ArraysMutex);
+  int64_t handle;
+  if (!FreeArrays.empty()) {
+    handle = FreeArrays.back();
+    FreeArrays.pop_back();
+  } else if (NextArray < KL_ARRAY_LIMIT) {
+    // The first handle of a page allocates it.
+    auto &page = kl_arrays[NextArray >> KL_ARRAY_PAGE_BITS];
+    if (page == EmptyPage &&
+        !(page = new (std::nothrow) KlArray[KL_ARRAY_PAGE_SIZE]()))
+      return 0;
+    handle = NextArray++;
+  } else {
+    return 0;
+  }
+  array_entry(handle) = {data, length};
+  return handle;
+}
+
+/// kl_array_new - allocate a zeroed array of `length` elements of
+/// `element_size` bytes and return its handle, or 0 if there is no room.
+extern "C" DLLEXPORT int64_t kl_array_new(int64_t length,
+                                          int64_t element_size) {
+  length = std::max<int64_t>(length, 0);
+  if (element_size <= 0 ||
+      length > (INT64_MAX - KL_ARRAY_ALIGNMENT) / element_size)
+    return 0;
+  // aligned_alloc wants a multiple of the alignment, and some bytes
+  auto bytes = (length * element_size + KL_ARRAY_ALIGNMENT) /
+               KL_ARRAY_ALIGNMENT * KL_ARRAY_ALIGNMENT;
+  auto *data = std::aligned_alloc(KL_ARRAY_ALIGNMENT, bytes);
+  if (!data)
+    return 0;
+  std::memset(data, 0, bytes);
+
+  auto handle = add_array(data, length);
+  if (!handle)
+    std::free(data);
+  return handle;
+}
+
+/// kl_array_free - release an array; other handles are ignored.
+extern "C" DLLEXPORT void kl_array_free(int64_t handle) {
+  if (handle <= 0 || handle >= KL_ARRAY_LIMIT)
+    return;
+  std::lock_guard<std::mutex> lock(ArraysMutex);
+  auto &array = array_entry(handle);
+  if (!array.Data)
+    return;
+#ifndef _WIN32
+  if (auto mapped = MappedArrays.find(handle); mapped != MappedArrays.end()) {
+    munmap(array.Data, mapped->second);
+    MappedArrays.erase(mapped);
+  } else
+#endif
+    std::free(array.Data);
+  array = {nullptr, 0};
+  FreeArrays.push_back(handle);
+}
+
+/// kl_bounds_error - report an index outside of an array and stop.
+extern "C" DLLEXPORT [[noreturn]] void kl_bounds_error(int64_t index,
+                                                       int64_t length) {
+  {
+    std::lock_guard<std::mutex> lock(Output.Mutex);
+    Output.flush();
+    fprintf(stderr, "\rError: index %lld is out of bounds for length %lld\n",
+            static_cast<long long>(index), static_cast<long long>(length));
+  }
+  std::abort();
+}
+
+// Input
+//
+// mapfile(i) and mapdata() make an array of a binary file of numbers in the
+// precision of the program (doubles unless it is built for floats), named by
+// the program argument i or by the environment variable KL_DATA. The file is
+// mapped copy-on-write rather than read, so only the pages the program
+// touches are loaded and writes to the array do not reach the file.
+
+template <typename Num> static Num map_file_(const char *path) {
+  auto fail = [path] {
+    std::lock_guard<std::mutex> lock(Output.Mutex);
+    Output.flush();
+    fprintf(stderr, "\rError: cannot map %s: %s\n", path,
+            std::strerror(errno));
+    return 0;
+  };
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return fail();
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    close(fd);
+    return fail();
+  }
+  size_t bytes = status.st_size;
+  int64_t length = bytes / sizeof(Num);
+  if (length == 0) {
+    close(fd);
+    return kl_array_new(0, sizeof(Num));
+  }
+  void *data =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return fail();
+
+  auto handle = add_array(data, length);
+  if (!handle) {
+    munmap(data, bytes);
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(ArraysMutex);
+  MappedArrays[handle] = bytes;
+  return handle;
+#else
+  // No mmap: read the file into a new array.
+  auto *file = fopen(path, "rb");
+  if (!file)
+    return fail();
+  fseek(file, 0, SEEK_END);
+  int64_t length = ftell(file) / sizeof(Num);
+  fseek(file, 0, SEEK_SET);
+  auto handle = kl_array_new(length, sizeof(Num));
+  if (handle && fread(array_entry(handle).Data, sizeof(Num), length,
+                      file) != static_cast<size_t>(length)) {
+    kl_array_free(handle);
+    handle = 0;
+  }
+  fclose(file);
+  return handle ? handle : fail();
+#endif
+}
+
+/// mapfile - map the file named by the i-th program argument; returns the
+/// array, or 0 if the file cannot be mapped.
+template <typename Num> static Num mapfile_(Num X) {
+  int i = static_cast<int>(X) + 1;
+  if (X < 0 || i >= kl_argc)
+    return 0;
+  return map_file_<Num>(kl_argv[i]);
+}
+
+/// mapdata - map the file named by KL_DATA; 0 if it is not set or the file
+/// cannot be mapped.
+template <typename Num> static Num mapdata_() {
+  auto *path = std::getenv("KL_DATA");
+  return path ? map_file_<Num>(path) : 0;
+}
+
+// readnum() parses the next number of stdin, which is read in large blocks;
+// numbers are separated by white space. eof() is 1 once only white space is
+// left. In the REPL, stdin is also where the code comes from.
+
+namespace {
+class InputBuffer {
+  char Data[1 << 16];
+  size_t Begin = 0;
+  size_t End = 0;
+  bool AtEnd = false;
+
+  // Moves the unread text to the front and reads more after it.
+  bool fill() {
+    if (AtEnd || (Begin == 0 && End == sizeof(Data)))
+      return false;
+    std::memmove(Data, Data + Begin, End - Begin);
+    End -= Begin;
+    Begin = 0;
+    auto count = fread(Data + End, 1, sizeof(Data) - End, stdin);
+    End += count;
+    AtEnd = count == 0;
+    return count > 0;
+  }
+
+  static bool is_space(char c) {
+    return std::isspace(static_cast<unsigned char>(c));
+  }
+
+public:
+  std::mutex Mutex;
+
+  // Callers hold Mutex.
+  bool skip_space() {
+    while (true) {
+      while (Begin < End && is_space(Data[Begin]))
+        ++Begin;
+      if (Begin < End)
+        return true;
+      if (!fill())
+        return false;
+    }
+  }
+
+  // The next number, 0 at the end of the input and NaN for text that is not
+  // a number.
+  double read() {
+    if (!skip_space())
+      return 0;
+    size_t end = Begin;
+    while (true) {
+      while (end < End && !is_space(Data[end]))
+        ++end;
+      size_t offset = end - Begin;
+      if (end < End || !fill())
+        break;
+      end = Begin + offset;
+    }
+
+    double value;
+    auto [rest, error] = std::from_chars(Data + Begin, Data + end, value);
+    if (error != std::errc() || rest != Data + end)
+      value = NAN;
+    Begin = end;
+    return value;
+  }
+};
+} // namespace
+
+static InputBuffer Input;
+
+template <typename Num> static Num readnum_() {
+  std::lock_guard<std::mutex> lock(Input.Mutex);
+  return static_cast<Num>(Input.read());
+}
+
+template <typename Num> static Num eof_() {
+  std::lock_guard<std::mutex> lock(Input.Mutex);
+  return !Input.skip_space();
+}
+
+// parfor
+//
+// kl_parallel_for runs the iterations [0, n) of an outlined loop body on a
+// pool of threads: the calling thread and KL_NUM_THREADS - 1 workers, all the
+// hardware threads by default. The iterations are cut into chunks, and each
+// participant starts with an equal share of them, a range of chunk numbers in
+// one atomic word. It takes chunks from the front of its share; one that runs
+// out steals the back half of the largest remaining share with a
+// compare-and-swap. Jobs started from different threads run at the same time,
+// each with the workers that join it; the shares of workers that are busy
+// elsewhere are stolen by the others. A parfor nested in a parfor body runs on
+// the thread that reaches it.
+//
+// kl_parallel_reduce does the same for parreduce, whose bodies return the
+// reduction of their chunk. Every participant combines the results of its
+// chunks, and the caller combines the participants'.
+
+namespace {
+using ParallelBody = void (*)(void *env, int64_t begin, int64_t end);
+template <typename Num>
+using ReduceBody = Num (*)(void *env, int64_t begin, int64_t end);
+
+// Chunks [front, back) of a job, packed as front << 32 | back. A job has at
+// most a few chunks per thread.
+struct alignas(64) Share {
+  std::atomic<uint64_t> Chunks = 0;
+};
+
+static uint64_t pack_chunks(uint64_t front, uint64_t back) {
+  return front << 32 | back;
+}
+static uint32_t get_front(uint64_t chunks) { return chunks >> 32; }
+static uint32_t get_back(uint64_t chunks) { return chunks & 0xffffffff; }
+
+struct ParallelJob {
+  // Runs a chunk on participant `self`
+  std::function<void(unsigned self, int64_t begin, int64_t end)> Chunk;
+  int64_t N;     // iterations
+  int64_t Grain; // iterations per chunk
+  std::vector<Share> Shares;
+  std::atomic<int64_t> Remaining; // chunks not yet run
+  // Guarded by the pool's mutex
+  unsigned NextShare = 1; // the caller runs share 0
+  unsigned Active = 0;    // workers running the job
+};
+
+class ThreadPool {
+  // Only guards the list of jobs and the workers joining and leaving them;
+  // chunks are taken and stolen without it.
+  std::mutex Mutex;
+  std::condition_variable WorkReady, WorkDone;
+  std::vector<ParallelJob *> Jobs;
+  unsigned Workers;
+
+  ParallelJob *find_job();
+  void work();
+
+public:
+  explicit ThreadPool(unsigned threads);
+  unsigned get_threads() const { return Workers + 1; }
+  void run(ParallelJob &job);
+};
+} // namespace
+
+static thread_local bool InParallelFor = false;
+
+// Takes the chunk at the front of `share`.
+static bool take_chunk(Share &share, uint32_t &chunk) {
+  auto chunks = share.Chunks.load(std::memory_order_acquire);
+  while (get_front(chunks) < get_back(chunks))
+    if (share.Chunks.compare_exchange_weak(
+            chunks, pack_chunks(get_front(chunks) + 1, get_back(chunks)),
+            std::memory_order_acq_rel)) {
+      chunk = get_front(chunks);
+      return true;
+    }
+  return false;
+}
+
+// Moves the back half of the largest other share into the empty share of
+// `self`. Nobody else changes an empty share, so it is simply stored.
+static bool steal(ParallelJob &job, unsigned self) {
+  while (true) {
+    unsigned victim = self;
+    uint64_t victim_chunks = 0;
+    uint32_t most = 0;
+    for (unsigned i = 0, e = job.Shares.size(); i != e; ++i) {
+      auto chunks = job.Shares[i].Chunks.load(std::memory_order_acquire);
+      if (i != self && get_front(chunks) < get_back(chunks) &&
+          get_back(chunks) - get_front(chunks) > most) {
+        most = get_back(chunks) - get_front(chunks);
+        victim = i;
+        victim_chunks = chunks;
+      }
+    }
+    if (victim == self)
+      return false;
+
+    uint32_t back = get_back(victim_chunks);
+    uint32_t middle = back - std::max<uint32_t>(most / 2, 1);
+    // Fails if the victim or another thief got there first; look again.
+    if (job.Shares[victim].Chunks.compare_exchange_strong(
+            victim_chunks, pack_chunks(get_front(victim_chunks), middle),
+            std::memory_order_acq_rel)) {
+      job.Shares[self].Chunks.store(pack_chunks(middle, back),
+                                    std::memory_order_release);
+      return true;
+    }
+  }
+}
+
+static void run_share(ParallelJob &job, unsigned self) {
+  InParallelFor = true;
+  uint32_t chunk;
+  while (true) {
+    if (take_chunk(job.Shares[self], chunk)) {
+      int64_t begin = chunk * job.Grain;
+      job.Chunk(self, begin, std::min(job.N, begin + job.Grain));
+      job.Remaining.fetch_sub(1, std::memory_order_relaxed);
+    } else if (!steal(job, self)) {
+      break;
+    }
+  }
+  InParallelFor = false;
+}
+
+ThreadPool::ThreadPool(unsigned threads) : Workers(threads - 1) {
+  // The workers live as long as the process.
+  for (unsigned i = 0; i != Workers; ++i)
+    std::thread(&ThreadPool::work, this).detach();
+}
+
+// A job with a share nobody runs yet and chunks left. Callers hold Mutex.
+ParallelJob *ThreadPool::find_job() {
+  for (auto *job : Jobs)
+    if (job->NextShare < job->Shares.size() &&
+        job->Remaining.load(std::memory_order_relaxed) > 0)
+      return job;
+  return nullptr;
+}
+
+void ThreadPool::work() {
+  while (true) {
+    ParallelJob *job;
+    unsigned share;
+    {
+      std::unique_lock<std::mutex> lock(Mutex);
+      WorkReady.wait(lock, [&] { return (job = find_job()); });
+      share = job->NextShare++;
+      ++job->Active;
+    }
+    run_share(*job, share);
+    std::lock_guard<std::mutex> lock(Mutex);
+    if (--job->Active == 0)
+      WorkDone.notify_all();
+  }
+}
+
+void ThreadPool::run(ParallelJob &job) {
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Jobs.push_back(&job);
+  }
+  WorkReady.notify_all();
+  run_share(job, 0);
+
+  // Every share was empty when the caller finished its own, so once no new
+  // worker can join, the job is done when the workers running it are.
+  std::unique_lock<std::mutex> lock(Mutex);
+  Jobs.erase(std::find(Jobs.begin(), Jobs.end(), &job));
+  WorkDone.wait(lock, [&] { return job.Active == 0; });
+}
+
+static ThreadPool &get_thread_pool() {
+  // Leaked, so exiting does not wait for the workers.
+  static auto *pool = [] {
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+    if (auto *env = std::getenv("KL_NUM_THREADS"))
+      threads = std::max(std::atoi(env), 1);
+    return new ThreadPool(threads);
+  }();
+  return *pool;
+}
+
+// Whether n iterations are better run on the calling thread
+static bool run_inline(int64_t n) {
+  return InParallelFor || n <= 1 || get_thread_pool().get_threads() == 1;
+}
+
+// Runs chunk(self, begin, end) over [0, n) on the pool, with about eight
+// chunks per thread.
+template <typename ChunkFn> static void run_parallel(int64_t n, ChunkFn chunk) {
+  auto &pool = get_thread_pool();
+  unsigned threads = pool.get_threads();
+  int64_t grain = std::max<int64_t>(n / (threads * 8), 1);
+  int64_t chunks = (n + grain - 1) / grain;
+  ParallelJob job{chunk, n, grain, std::vector<Share>(threads), chunks};
+  for (unsigned i = 0; i != threads; ++i)
+    job.Shares[i].Chunks = pack_chunks(chunks * i / threads,
+                                       chunks * (i + 1) / threads);
+  pool.run(job);
+}
+
+/// kl_parallel_for - run body(env, begin, end) over chunks of [0, n), in
+/// parallel.
+extern "C" DLLEXPORT void kl_parallel_for(ParallelBody body, void *env,
+                                          int64_t n) {
+  if (n <= 0)
+    return;
+  if (run_inline(n))
+    return body(env, 0, n);
+
+  run_parallel(n, [&](unsigned, int64_t begin, int64_t end) {
+    body(env, begin, end);
+  });
+}
+
+// Operators of parreduce, numbered as ReduceOp in ast.h
+enum { ReduceAdd = 1, ReduceMul, ReduceMin, ReduceMax };
+
+template <typename Num> static Num reduce(int op, Num result, Num value) {
+  switch (op) {
+  case ReduceAdd:
+    return result + value;
+  case ReduceMul:
+    return result * value;
+  case ReduceMin:
+    return std::fmin(result, value);
+  default:
+    return std::fmax(result, value);
+  }
+}
+
+/// kl_parallel_reduce - reduce the results of body(env, begin, end) over
+/// chunks of [0, n) with `op`, in parallel. body(env, 0, 0) returns the
+/// identity of `op`.
+template <typename Num>
+static Num kl_parallel_reduce_(ReduceBody<Num> body, void *env, int64_t n,
+                               int op) {
+  if (run_inline(n))
+    return body(env, 0, n);
+
+  // Participants that ran no chunk have no result.
+  std::vector<std::optional<Num>> results(get_thread_pool().get_threads());
+  run_parallel(n, [&](unsigned self, int64_t begin, int64_t end) {
+    Num value = body(env, begin, end);
+    auto &result = results[self];
+    result = result ? reduce(op, *result, value) : value;
+  });
+
+  std::optional<Num> total;
+  for (auto &result : results)
+    if (result)
+      total = total ? reduce(op, *total, *result) : *result;
+  return *total;
+}
+
+// Entry points
+//
+
+extern "C" DLLEXPORT kl_num putchard(kl_num X) { return putchard_(X); }
+extern "C" DLLEXPORT kl_num print(kl_num X) { return print_(X); }
+extern "C" DLLEXPORT kl_num printd(kl_num X) { return printd_(X); }
+extern "C" DLLEXPORT kl_num flush() { return flush_<kl_num>(); }
+extern "C" DLLEXPORT kl_num nargs() { return nargs_<kl_num>(); }
+extern "C" DLLEXPORT kl_num arg(kl_num X) { return arg_(X); }
+extern "C" DLLEXPORT kl_num memostats() { return memostats_<kl_num>(); }
+extern "C" DLLEXPORT kl_num memolimit(kl_num X) { return memolimit_(X); }
+extern "C" DLLEXPORT kl_num mapfile(kl_num X) { return mapfile_(X); }
+extern "C" DLLEXPORT kl_num mapdata() { return mapdata_<kl_num>(); }
+extern "C" DLLEXPORT kl_num readnum() { return readnum_<kl_num>(); }
+extern "C" DLLEXPORT kl_num eof() { return eof_<kl_num>(); }
+
+extern "C" DLLEXPORT int kl_memo_lookup(void **slot, const char *name,
+                                        const kl_num *args, int n,
+                                        kl_num *result) {
+  return kl_memo_lookup_(slot, name, args, n, result);
+}
+
+extern "C" DLLEXPORT void kl_memo_store(void **slot, const kl_num *args,
+                                        int n, kl_num result) {
+  kl_memo_store_(slot, args, n, result);
+}
+
+extern "C" DLLEXPORT kl_num kl_parallel_reduce(ReduceBody<kl_num> body,
+                                               void *env, int64_t n, int op) {
+  return kl_parallel_reduce_(body, env, n, op);
+}
+
+#ifndef KL_SINGLE_PRECISION
+extern "C" DLLEXPORT float kl_f32_putchard(float X) { return putchard_(X); }
+extern "C" DLLEXPORT float kl_f32_print(float X) { return print_(X); }
+extern "C" DLLEXPORT float kl_f32_printd(float X) { return printd_(X); }
+extern "C" DLLEXPORT float kl_f32_flush() { return flush_<float>(); }
+extern "C" DLLEXPORT float kl_f32_nargs() { return nargs_<float>(); }
+extern "C" DLLEXPORT float kl_f32_arg(float X) { return arg_(X); }
+extern "C" DLLEXPORT float kl_f32_memostats() { return memostats_<float>(); }
+extern "C" DLLEXPORT float kl_f32_memolimit(float X) { return memolimit_(X); }
+extern "C" DLLEXPORT float kl_f32_mapfile(float X) { return mapfile_(X); }
+extern "C" DLLEXPORT float kl_f32_mapdata() { return mapdata_<float>(); }
+extern "C" DLLEXPORT float kl_f32_readnum() { return readnum_<float>(); }
+extern "C" DLLEXPORT float kl_f32_eof() { return eof_<float>(); }
+
+extern "C" DLLEXPORT int kl_f32_kl_memo_lookup(void **slot, const char *name,
+                                               const float *args, int n,
+                                               float *result) {
+  return kl_memo_lookup_(slot, name, args, n, result);
+}
+
+extern "C" DLLEXPORT void kl_f32_kl_memo_store(void **slot, const float *args,
+                                               int n, float result) {
+  kl_memo_store_(slot, args, n, result);
+}
+
+extern "C" DLLEXPORT float kl_f32_kl_parallel_reduce(ReduceBody<float> body,
+                                                     void *env, int64_t n,
+                                                     int op) {
+  return kl_parallel_reduce_(body, env, n, op);
+}
+#endif
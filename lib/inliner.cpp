@@ -0,0 +1,150 @@
+#include "inliner.h"
+#include "effects.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <functional>
+#include <set>
+
+struct InlineRecord {
+  std::unique_ptr<Module> Pristine;
+  std::unique_ptr<Module> Optimized;
+  // Callees whose bodies were copied in or whose inferred effects the
+  // optimizer relied on
+  std::set<std::string> DependsOn;
+};
+
+static std::map<std::string, InlineRecord> Records;
+
+static std::unique_ptr<Module> copy_function(const Function &F) {
+  auto M = std::make_unique<Module>(F.getName(), F.getContext());
+  M->setDataLayout(F.getParent()->getDataLayout());
+  copy_function_into(F, *M, true);
+  return M;
+}
+
+// Declarations, such as the runtime's array table, are shared rather than
+// duplicated.
+static bool references_globals(const Function &F) {
+  for (auto &I : instructions(F))
+    for (auto &op : I.operands())
+      if (auto *global = dyn_cast<GlobalVariable>(op);
+          global && !global->isDeclaration())
+        return true;
+  return false;
+}
+
+void keep_pristine_copy(const Function &F) {
+  auto &record = Records[F.getName().str()];
+  record.Pristine = copy_function(F);
+  record.Optimized.reset();
+  record.DependsOn.clear();
+}
+
+void keep_optimized_copy(const Function &F) {
+  // Globals would be duplicated in every module the body is copied into.
+  if (references_globals(F) || F.getInstructionCount() > INLINE_SIZE_LIMIT)
+    return;
+  Records[F.getName().str()].Optimized = copy_function(F);
+}
+
+void inline_small_callees(Function &F) {
+  std::set<std::string> callees;
+  for (auto &I : instructions(F))
+    if (auto *call = dyn_cast<CallInst>(&I))
+      if (auto *callee = call->getCalledFunction();
+          callee && callee != &F && callee->isDeclaration())
+        callees.insert(callee->getName().str());
+
+  std::set<std::string> *depends_on = nullptr;
+  if (auto record = Records.find(F.getName().str()); record != Records.end())
+    depends_on = &record->second.DependsOn;
+
+  for (auto &name : callees) {
+    auto record = Records.find(name);
+    if (record == Records.end())
+      continue;
+    if (depends_on && known_effects(name))
+      depends_on->insert(name);
+    if (!record->second.Optimized)
+      continue;
+
+    auto *body = copy_function_into(
+        *record->second.Optimized->getFunction(name), *F.getParent());
+    std::vector<CallBase *> calls;
+    for (auto *user : body->users())
+      if (auto *call = dyn_cast<CallBase>(user);
+          call && call->getFunction() == &F && call->getCalledFunction() == body)
+        calls.push_back(call);
+    for (auto *call : calls) {
+      InlineFunctionInfo IFI;
+      InlineFunction(*call, IFI);
+    }
+    // The JIT links calls that were not inlined against the real definition.
+    body->deleteBody();
+
+    if (depends_on)
+      depends_on->insert(name);
+  }
+}
+
+void forget_inlined_body(const std::string &name) {
+  if (auto record = Records.find(name); record != Records.end())
+    record->second.Optimized.reset();
+}
+
+void forget_function(const std::string &name) { Records.erase(name); }
+
+const Function *pristine_copy(const std::string &name) {
+  auto record = Records.find(name);
+  if (record == Records.end() || !record->second.Pristine)
+    return nullptr;
+  return record->second.Pristine->getFunction(name);
+}
+
+void depend_on(const Function &F, const std::string &callee) {
+  if (auto record = Records.find(F.getName().str()); record != Records.end())
+    record->second.DependsOn.insert(callee);
+}
+
+std::vector<std::string> stale_inliners(const std::string &name) {
+  std::set<std::string> stale;
+  std::vector<std::string> pending = {name};
+  while (!pending.empty()) {
+    auto callee = pending.back();
+    pending.pop_back();
+    for (auto &[caller, record] : Records)
+      if (record.DependsOn.count(callee) && stale.insert(caller).second)
+        pending.push_back(caller);
+  }
+
+  // Definition order is not enough: a rebuilt function is newer than the
+  // functions that inline it.
+  std::vector<std::string> ordered;
+  std::set<std::string> visited;
+  std::function<void(const std::string &)> visit = [&](auto &caller) {
+    if (!visited.insert(caller).second)
+      return;
+    for (auto &callee : Records[caller].DependsOn)
+      if (stale.count(callee))
+        visit(callee);
+    ordered.push_back(caller);
+  };
+  for (auto &caller : stale)
+    visit(caller);
+  return ordered;
+}
+
+Function *rebuild_function(const std::string &name) {
+  auto record = Records.find(name);
+  if (record == Records.end() || !record->second.Pristine)
+    return nullptr;
+
+  // optimize_function() replaces the record, keep the source alive until then.
+  auto pristine = std::move(record->second.Pristine);
+  auto *F =
+      copy_function_into(*pristine->getFunction(name), *TheModule, true);
+  verifyFunction(*F);
+  optimize_function(*F);
+  return F;
+}
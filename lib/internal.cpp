@@ -1,25 +1,81 @@
 #include "internal.h"
+#include "effects.h"
+#include "consteval.h"
+#include "inliner.h"
+#include "simd.h"
+#include "specializer.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/CodeGen.h"
+#include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/TargetParser/Host.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Scalar/WarnMissedTransforms.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/InjectTLIMappings.h"
 #include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 
 bool DEBUG = false;
+bool PRINT_PASSES = false;
+bool BATCH_MODE = false;
+bool TIERED = false;
+bool JIT_INLINING = false;
+bool CONST_EVAL = false;
+bool SIMD_VARIANTS = false;
+FastMathFlags FAST_MATH;
+bool SINGLE_PRECISION = false;
+bool BOUNDS_CHECK = true;
 
-std::unique_ptr<LLVMContext> TheContext;
+// -fveclib: the vector math library vectorized loops call, and the shared
+// library the REPL loads it from.
+namespace {
+struct VectorLibrary {
+  const char *Option;
+  TargetLibraryInfoImpl::VectorLibrary Library;
+  const char *SharedLibrary;
+};
+} // namespace
+
+static const VectorLibrary VectorLibraries[] = {
+    {"none", TargetLibraryInfoImpl::NoLibrary, nullptr},
+    {"libmvec", TargetLibraryInfoImpl::LIBMVEC_X86, "libmvec.so.1"},
+    {"SVML", TargetLibraryInfoImpl::SVML, "libsvml.so"},
+    {"SLEEF", TargetLibraryInfoImpl::SLEEFGNUABI, "libsleefgnuabi.so"},
+    {"AMDLIBM", TargetLibraryInfoImpl::AMDLIBM, "libalm.so"},
+    {"ArmPL", TargetLibraryInfoImpl::ArmPL, "libamath.so"},
+    {"Accelerate", TargetLibraryInfoImpl::Accelerate,
+     "/System/Library/Frameworks/Accelerate.framework/Accelerate"},
+};
+static const VectorLibrary *TheVectorLibrary = &VectorLibraries[0];
+
+ThreadSafeContext TheTSC;
+LLVMContext *TheContext;
 std::unique_ptr<IRBuilder<>> Builder;
 std::unique_ptr<Module> TheModule;
 std::map<std::string, AllocaInst *> NamedValues;
 std::unique_ptr<KaleidoscopeJIT> TheJIT;
 std::unique_ptr<FunctionPassManager> TheFPM;
+std::unique_ptr<FunctionPassManager> TheTier0FPM;
 std::unique_ptr<LoopAnalysisManager> TheLAM;
 std::unique_ptr<FunctionAnalysisManager> TheFAM;
 std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
@@ -36,47 +92,279 @@ std::map<std::string, int> BINOP_PRECEDENCE = {
     {"=", 2}, {"<", 10}, {">", 10}, {"+", 20}, {"-", 20}, {"*", 40},
 };
 
-AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name) {
+AllocaInst *create_entry_block_alloca(Function *function, StringRef var_name,
+                                      Type *type) {
   IRBuilder<> temp_builder(&function->getEntryBlock(),
                            function->getEntryBlock().begin());
-  return temp_builder.CreateAlloca(Type::getDoubleTy(*TheContext), nullptr,
+  return temp_builder.CreateAlloca(type ? type : get_num_type(), nullptr,
                                    var_name);
 }
 
-void initialize_modules_and_managers_for_jit() {
-  // Open a new context and module.
-
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("K++ JIT", *TheContext);
-
-  TheModule->setDataLayout(TheJIT->getDataLayout());
+// Loop hints the optimizer could not follow are warnings; other diagnostics
+// keep LLVM's default handling.
+namespace {
+struct LoopHintDiagnostics : DiagnosticHandler {
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    auto *failure = dyn_cast<DiagnosticInfoOptimizationFailure>(&DI);
+    if (!failure)
+      return false;
+    auto function = failure->getFunction().getName();
+    if (failure->isLocationAvailable())
+      fprintf(stderr, "\rWarning: line %u in `%s`: %s\n",
+              failure->getLocation().getLine(), function.str().c_str(),
+              failure->getMsg().c_str());
+    else
+      fprintf(stderr, "\rWarning: in `%s`: %s\n", function.str().c_str(),
+              failure->getMsg().c_str());
+    return true;
+  }
+};
+} // namespace
 
+// Pass managers and analysis registrations live as long as the context does;
+// only the module is recreated for every unit.
+static void initialize_pass_managers() {
   TheFPM = std::make_unique<FunctionPassManager>();
   TheLAM = std::make_unique<LoopAnalysisManager>();
   TheFAM = std::make_unique<FunctionAnalysisManager>();
   TheCGAM = std::make_unique<CGSCCAnalysisManager>();
   TheMAM = std::make_unique<ModuleAnalysisManager>();
   ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
+  TheContext->setDiagnosticHandler(std::make_unique<LoopHintDiagnostics>());
 
-  TheSI->registerCallbacks(*ThePIC, TheMAM.get());
+  // Instrumentation is opt-in, otherwise it is pure overhead on every run.
+  if (PRINT_PASSES) {
+    TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
+    TheSI->registerCallbacks(*ThePIC, TheMAM.get());
+  }
 
-  // Add passes
+  // Add passes. Variables live in allocas until mem2reg; run it first so the
+  // rest of the pipeline sees SSA values.
+  TheFPM->addPass(PromotePass());
   TheFPM->addPass(InstCombinePass());
   TheFPM->addPass(ReassociatePass());
   TheFPM->addPass(GVNPass());
   TheFPM->addPass(SimplifyCFGPass());
-  TheFPM->addPass(PromotePass());
+  // Turns self-recursive tail calls into loops. kppc optimizes every
+  // definition with this pipeline too; --run gets the pass from the O2 module
+  // pipeline.
+  TheFPM->addPass(TailCallElimPass());
+
+  // Loop pipeline, for `for` loops and the loops left by TailCallElim
+  LoopPassManager LPM;
+  LPM.addPass(LoopRotatePass());
+  LPM.addPass(LICMPass());
+  LPM.addPass(IndVarSimplifyPass());
+  TheFPM->addPass(
+      createFunctionToLoopPassAdaptor(std::move(LPM), /*UseMemorySSA=*/true));
+  // Tells the vectorizer which vector math functions exist
+  TheFPM->addPass(InjectTLIMappings());
+  TheFPM->addPass(LoopVectorizePass());
+  TheFPM->addPass(LoopUnrollPass());
+  TheFPM->addPass(SLPVectorizerPass());
+  // Reports `for` hints that were not followed, see LoopHintDiagnostics.
+  TheFPM->addPass(WarnMissedTransformationsPass());
+  TheFPM->addPass(InstCombinePass());
+  TheFPM->addPass(SimplifyCFGPass());
 
-  PassBuilder PB;
+  // Quick pipeline for the first tier of --tiered
+  TheTier0FPM = std::make_unique<FunctionPassManager>();
+  TheTier0FPM->addPass(PromotePass());
+  TheTier0FPM->addPass(InstCombinePass());
+  TheTier0FPM->addPass(SimplifyCFGPass());
+  TheTier0FPM->addPass(TailCallElimPass());
+
+  // Math calls in vectorized loops go to the vector library.
+  auto &triple = TheTargetMachine->getTargetTriple();
+  TargetLibraryInfoImpl TLII(triple);
+  TLII.addVectorizableFunctionsFromVecLib(TheVectorLibrary->Library, triple);
+  TheFAM->registerPass([&] { return TargetLibraryAnalysis(TLII); });
+
+  // The target machine provides the cost model for unrolling and
+  // vectorization.
+  PassBuilder PB(TheTargetMachine, PipelineTuningOptions(), std::nullopt,
+                 PRINT_PASSES ? ThePIC.get() : nullptr);
   PB.registerModuleAnalyses(*TheMAM);
+  PB.registerCGSCCAnalyses(*TheCGAM);
   PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
   PB.crossRegisterProxies(
       *TheLAM, *TheFAM, *TheCGAM,
       *TheMAM); // I don't know why the other two were registerd separately
+}
 
-  // Create a new builder for the module.
+void optimize_function(Function &F) {
+  // Batch mode optimizes the whole module at once, and debug builds are not
+  // optimized at all.
+  if (DEBUG || BATCH_MODE)
+    return;
+
+  // Tiered definitions start out quick to compile; hot ones are recompiled
+  // later. Top-level expressions only run once and are not tiered.
+  bool anonymous = F.getName().starts_with(ANON_FUNCTION);
+  if (TIERED && !anonymous) {
+    TheTier0FPM->run(F, *TheFAM);
+    infer_effects(F);
+    return;
+  }
+
+  // Small definitions from earlier units are pulled in before optimizing, so
+  // they are simplified together with the caller. Calls to larger ones with
+  // constant arguments go to specialized copies.
+  if (JIT_INLINING) {
+    if (!anonymous)
+      keep_pristine_copy(F);
+    inline_small_callees(F);
+    specialize_constant_calls(F);
+  }
+  TheFPM->run(F, *TheFAM);
+  // After optimization the body no longer refers to its variables' allocas.
+  infer_effects(F);
+  // Pure calls with constant arguments are run now, and their results
+  // simplified further.
+  if (CONST_EVAL && fold_constant_calls(F)) {
+    TheFAM->invalidate(F, PreservedAnalyses::none());
+    TheFPM->run(F, *TheFAM);
+    infer_effects(F);
+  }
+  if (JIT_INLINING && !anonymous)
+    keep_optimized_copy(F);
+  // Callers defined later can then be vectorized.
+  if (SIMD_VARIANTS)
+    add_simd_variants(F);
+}
+
+Function *copy_function_into(const Function &src, Module &dst,
+                             bool define_globals) {
+  auto *F = dst.getFunction(src.getName());
+  if (!F)
+    F = Function::Create(src.getFunctionType(), Function::ExternalLinkage,
+                         src.getName(), dst);
+
+  ValueToValueMapTy VMap;
+  VMap[&src] = F;
+  for (auto [from, to] : zip(src.args(), F->args())) {
+    to.setName(from.getName());
+    VMap[&from] = &to;
+  }
+  for (auto &I : instructions(src))
+    for (auto &op : I.operands())
+      if (auto *callee = dyn_cast<Function>(op); callee && callee != &src) {
+        auto *declaration = dst.getFunction(callee->getName());
+        if (!declaration) {
+          declaration =
+              Function::Create(callee->getFunctionType(),
+                               Function::ExternalLinkage, callee->getName(), dst);
+          // The attributes `src` was compiled against may be out of date.
+          apply_known_effects(*declaration);
+        }
+        VMap[callee] = declaration;
+      } else if (auto *global = dyn_cast<GlobalVariable>(op)) {
+        // Local constants, such as the name of a memo def, are duplicated.
+        // Other globals, such as the cache slot of a memo def or the
+        // runtime's array table, are declared, so the copy shares them with
+        // the original.
+        auto *copy = dst.getGlobalVariable(global->getName(), true);
+        if (!copy) {
+          bool define = global->hasInitializer() &&
+                        (define_globals || global->hasLocalLinkage());
+          copy = new GlobalVariable(
+              dst, global->getValueType(), global->isConstant(),
+              define ? global->getLinkage() : GlobalValue::ExternalLinkage,
+              define ? global->getInitializer() : nullptr, global->getName());
+          copy->copyAttributesFrom(global);
+        }
+        VMap[global] = copy;
+      }
+
+  SmallVector<ReturnInst *, 4> returns;
+  CloneFunctionInto(F, &src, VMap, CloneFunctionChangeType::DifferentModule,
+                    returns);
+  return F;
+}
+
+// Whole-module pipeline for code that is compiled as a single unit instead of
+// function by function.
+void optimize_module() {
+  PassBuilder PB(TheTargetMachine, PipelineTuningOptions(), std::nullopt,
+                 PRINT_PASSES ? ThePIC.get() : nullptr);
+  specialize_constant_calls(*TheModule);
+  infer_effects(*TheModule);
+  auto MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
+  MPM.run(*TheModule, *TheMAM);
+}
+
+bool parse_codegen_option(const char *option) {
+  if (std::strcmp(option, "--precision=single") == 0)
+    SINGLE_PRECISION = true;
+  else if (std::strcmp(option, "--precision=double") == 0)
+    SINGLE_PRECISION = false;
+  else if (std::strcmp(option, "-ffast-math") == 0)
+    FAST_MATH.setFast();
+  else if (std::strcmp(option, "-ffp-contract=fast") == 0)
+    FAST_MATH.setAllowContract(true);
+  else if (std::strcmp(option, "-ffp-contract=off") == 0)
+    FAST_MATH.setAllowContract(false);
+  else if (std::strcmp(option, "-fassociative-math") == 0)
+    FAST_MATH.setAllowReassoc();
+  else if (std::strcmp(option, "-fno-honor-nans") == 0)
+    FAST_MATH.setNoNaNs();
+  else if (std::strcmp(option, "-fno-honor-infinities") == 0)
+    FAST_MATH.setNoInfs();
+  else if (std::strcmp(option, "-fno-bounds-check") == 0)
+    BOUNDS_CHECK = false;
+  else if (std::strncmp(option, "-fveclib=", 9) == 0) {
+    auto library = std::find_if(
+        std::begin(VectorLibraries), std::end(VectorLibraries),
+        [&](auto &library) {
+          return std::strcmp(option + 9, library.Option) == 0;
+        });
+    if (library == std::end(VectorLibraries))
+      return false;
+    TheVectorLibrary = library;
+  } else
+    return false;
+  return true;
+}
+
+void initialize_modules_and_managers_for_jit() {
+  // One context is shared by every module handed to the JIT.
+  TheTSC = ThreadSafeContext(std::make_unique<LLVMContext>());
+  TheContext = TheTSC.getContext();
+
+  // Code runs on this machine, so it can be tuned for the host CPU.
+  TheTargetMachine =
+      ExitOnErr(ExitOnErr(JITTargetMachineBuilder::detectHost())
+                    .createTargetMachine())
+          .release();
+
+  // Vectorized code calls into the vector library, so it has to be loaded.
+  if (auto *file = TheVectorLibrary->SharedLibrary) {
+    std::string error;
+    if (sys::DynamicLibrary::LoadLibraryPermanently(file, &error)) {
+      fprintf(stderr, "Warning: -fveclib=%s: %s\n", TheVectorLibrary->Option,
+              error.c_str());
+      TheVectorLibrary = &VectorLibraries[0];
+    }
+  }
+
+  initialize_pass_managers();
+
+  // Create a new builder for the context.
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  Builder->setFastMathFlags(FAST_MATH);
+
+  initialize_module_for_jit();
+}
+
+void initialize_module_for_jit() {
+  // Cached analyses refer to functions of the previous unit, whose module is
+  // now owned by the JIT.
+  TheFAM->clear();
+  TheMAM->clear();
+
+  TheModule = std::make_unique<Module>("K++ JIT", *TheContext);
+  TheModule->setDataLayout(TheJIT->getDataLayout());
 }
 
 void initialize_module_for_compilation() {
@@ -98,40 +386,18 @@ void initialize_module_for_compilation() {
                                                  opt, Reloc::PIC_);
   // Open a new context and module.
 
-  TheContext = std::make_unique<LLVMContext>();
+  TheTSC = ThreadSafeContext(std::make_unique<LLVMContext>());
+  TheContext = TheTSC.getContext();
   TheModule = std::make_unique<Module>("K++ Compiler", *TheContext);
 
   TheModule->setDataLayout(TheTargetMachine->createDataLayout());
   TheModule->setTargetTriple(target_triple);
 
-  // TheModule->setDataLayout(TheJIT->getDataLayout());
-
-  TheFPM = std::make_unique<FunctionPassManager>();
-  TheLAM = std::make_unique<LoopAnalysisManager>();
-  TheFAM = std::make_unique<FunctionAnalysisManager>();
-  TheCGAM = std::make_unique<CGSCCAnalysisManager>();
-  TheMAM = std::make_unique<ModuleAnalysisManager>();
-  ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<StandardInstrumentations>(*TheContext, true);
-
-  TheSI->registerCallbacks(*ThePIC, TheMAM.get());
-
-  // Add passes
-  TheFPM->addPass(InstCombinePass());
-  TheFPM->addPass(ReassociatePass());
-  TheFPM->addPass(GVNPass());
-  TheFPM->addPass(SimplifyCFGPass());
-  TheFPM->addPass(PromotePass());
-
-  PassBuilder PB;
-  PB.registerModuleAnalyses(*TheMAM);
-  PB.registerFunctionAnalyses(*TheFAM);
-  PB.crossRegisterProxies(
-      *TheLAM, *TheFAM, *TheCGAM,
-      *TheMAM); // I don't know why the other two were registerd separately
+  initialize_pass_managers();
 
   // Create a new builder for the module.
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  Builder->setFastMathFlags(FAST_MATH);
 
   auto debug_env = std::getenv("DEBUG");
   if (debug_env && std::strcmp(debug_env, "1") == 0) {
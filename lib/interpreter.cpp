@@ -0,0 +1,337 @@
+#include "ast.h"
+#include "effects.h"
+#include "internal.h"
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <utility>
+
+// Values of the variables bound by `with` and `for` while interpreting. Only
+// the thread that evaluates top-level expressions touches it.
+static std::map<std::string, double> InterpretedValues;
+
+static unsigned cap_cost(unsigned cost) {
+  return std::min(cost, INTERPRET_COST_LIMIT + 1u);
+}
+
+// Same truth test as the `fcmp one` emitted for conditions.
+static bool is_true(double value) { return value < 0 || value > 0; }
+
+// Values are rounded the way compiled code rounds them.
+static double round_num(double value) {
+  return SINGLE_PRECISION ? static_cast<float>(value) : value;
+}
+
+template <typename Num, size_t... I>
+static double call_address(ExecutorAddr address, const std::vector<double> &args,
+                           std::index_sequence<I...>) {
+  using FnTy = Num (*)(decltype((void)I, Num())...);
+  return address.toPtr<FnTy>()(static_cast<Num>(args[I])...);
+}
+
+template <size_t N>
+static double call_address(ExecutorAddr address,
+                           const std::vector<double> &args) {
+  if (SINGLE_PRECISION)
+    return call_address<float>(address, args, std::make_index_sequence<N>());
+  return call_address<double>(address, args, std::make_index_sequence<N>());
+}
+
+// Calls a function that has already been compiled by the JIT (or is provided
+// by the process, like the builtins).
+static std::optional<double> call_compiled(const std::string &name,
+                                           const std::vector<double> &args) {
+  // Single-precision code links the float variants of libm.
+  auto symbol = TheJIT->lookup(
+      SINGLE_PRECISION && is_math_function(name) ? name + "f" : name);
+  if (!symbol) {
+    logAllUnhandledErrors(symbol.takeError(), errs(), "Error: ");
+    return std::nullopt;
+  }
+
+  auto address = symbol->getAddress();
+  switch (args.size()) {
+  case 0:
+    return call_address<0>(address, args);
+  case 1:
+    return call_address<1>(address, args);
+  case 2:
+    return call_address<2>(address, args);
+  case 3:
+    return call_address<3>(address, args);
+  case 4:
+    return call_address<4>(address, args);
+  case 5:
+    return call_address<5>(address, args);
+  case 6:
+    return call_address<6>(address, args);
+  default:
+    return log_error_i(
+        std::format("Can not interpret a call to {}", name).c_str());
+  }
+}
+
+// Only functions that are already known can be called from the interpreter.
+static unsigned call_cost(const std::string &name, size_t arg_count) {
+  // `min` and `max` only exist as intrinsics, in compiled code.
+  if (!is_math_function(name) &&
+      get_math_intrinsic(name, arg_count) != Intrinsic::not_intrinsic)
+    return INTERPRET_COST_LIMIT + 1;
+
+  auto proto = FunctionProtos.find(name);
+  if (proto == FunctionProtos.end() ||
+      proto->second->get_arg_size() != static_cast<int>(arg_count) ||
+      arg_count > INTERPRET_MAX_ARGS)
+    return INTERPRET_COST_LIMIT + 1;
+  return INTERPRET_CALL_COST;
+}
+
+std::optional<double> NumberExprAST::interpret() { return round_num(Val); }
+
+unsigned NumberExprAST::interpret_cost() const { return 1; }
+
+std::optional<double> VariableExprAST::interpret() {
+  if (auto value = InterpretedValues.find(Name);
+      value != InterpretedValues.end())
+    return value->second;
+  if (auto constant = Constants.find(Name); constant != Constants.end())
+    return constant->second;
+  return log_error_i("Unknown variable name");
+}
+
+unsigned VariableExprAST::interpret_cost() const { return 1; }
+
+std::optional<double> BinaryExprAST::interpret() {
+  if (Op == "=") {
+    auto LHSE = dyn_cast<VariableExprAST>(LHS.get());
+    if (!LHSE)
+      return log_error_i(
+          "Left hand side of assignment should be a valid identifier.");
+
+    auto val = RHS->interpret();
+    if (!val)
+      return std::nullopt;
+
+    auto variable = InterpretedValues.find(LHSE->get_name());
+    if (variable == InterpretedValues.end())
+      return log_error_i(
+          std::format("Variable {} does not exist.", LHSE->get_name()).c_str());
+
+    return variable->second = *val;
+  }
+
+  auto L = LHS->interpret();
+  auto R = RHS->interpret();
+  if (!L || !R)
+    return std::nullopt;
+
+  if (Op == "+")
+    return round_num(*L + *R);
+  if (Op == "-")
+    return round_num(*L - *R);
+  if (Op == "*")
+    return round_num(*L * *R);
+  // Unordered comparisons, as in codegen
+  if (Op == "<")
+    return !(*L >= *R) ? 1.0 : 0.0;
+  if (Op == ">")
+    return !(*R >= *L) ? 1.0 : 0.0;
+
+  return call_compiled(std::string("binary") + Op, {*L, *R});
+}
+
+unsigned BinaryExprAST::interpret_cost() const {
+  unsigned cost = 1 + LHS->interpret_cost() + RHS->interpret_cost();
+  if (Op != "=" && Op != "+" && Op != "-" && Op != "*" && Op != "<" &&
+      Op != ">")
+    cost += call_cost(std::string("binary") + Op, 2);
+  return cap_cost(cost);
+}
+
+std::optional<double> UnaryExprAST::interpret() {
+  auto operand = Operand->interpret();
+  if (!operand)
+    return std::nullopt;
+
+  return call_compiled(std::format("unary{}", Op), {*operand});
+}
+
+unsigned UnaryExprAST::interpret_cost() const {
+  return cap_cost(1 + Operand->interpret_cost() +
+                  call_cost(std::format("unary{}", Op), 1));
+}
+
+std::optional<double> CallExprAST::interpret() {
+  std::vector<double> ArgsV;
+  for (auto &expr : Args) {
+    auto arg = expr->interpret();
+    if (!arg)
+      return std::nullopt;
+    ArgsV.push_back(*arg);
+  }
+  return call_compiled(Callee, ArgsV);
+}
+
+unsigned CallExprAST::interpret_cost() const {
+  unsigned cost = 1 + call_cost(Callee, Args.size());
+  for (auto &expr : Args)
+    cost = cap_cost(cost + expr->interpret_cost());
+  return cost;
+}
+
+// Arrays live in the runtime, which only compiled code talks to.
+std::optional<double> IndexExprAST::interpret() {
+  return log_error_i("Arrays can only be used in compiled code");
+}
+
+unsigned IndexExprAST::interpret_cost() const {
+  return INTERPRET_COST_LIMIT + 1;
+}
+
+std::optional<double> IfExprAST::interpret() {
+  auto cond_val = Condition->interpret();
+  if (!cond_val)
+    return std::nullopt;
+
+  return is_true(*cond_val) ? Then->interpret() : Else->interpret();
+}
+
+unsigned IfExprAST::interpret_cost() const {
+  return cap_cost(1 + Condition->interpret_cost() + Then->interpret_cost() +
+                  Else->interpret_cost());
+}
+
+static double reduce(ReduceOp op, double result, double value) {
+  switch (op) {
+  case ReduceOp::Add:
+    return round_num(result + value);
+  case ReduceOp::Mul:
+    return round_num(result * value);
+  case ReduceOp::Min:
+    return std::fmin(result, value);
+  case ReduceOp::Max:
+    return std::fmax(result, value);
+  default:
+    return result;
+  }
+}
+
+std::optional<double> ForExprAST::interpret() {
+  auto start = Start->interpret();
+  if (!start)
+    return std::nullopt;
+
+  auto old_value = InterpretedValues.find(VarName);
+  std::optional<double> shadowed;
+  if (old_value != InterpretedValues.end())
+    shadowed = old_value->second;
+
+  InterpretedValues[VarName] = *start;
+  double result = get_reduce_identity(Reduction);
+  bool ok = false;
+  while (true) {
+    auto condition = Condition->interpret();
+    if (!condition)
+      break;
+    if (!is_true(*condition)) {
+      ok = true;
+      break;
+    }
+
+    auto body = Body->interpret();
+    if (!body)
+      break;
+    result = reduce(Reduction, result, *body);
+    auto step = Step->interpret();
+    if (!step)
+      break;
+    auto &value = InterpretedValues[VarName];
+    value = round_num(value + *step);
+  }
+
+  if (shadowed)
+    InterpretedValues[VarName] = *shadowed;
+  else
+    InterpretedValues.erase(VarName);
+
+  if (!ok)
+    return std::nullopt;
+  return result;
+}
+
+// A loop costs its trip count times an iteration, so only `for i = a, i < b,
+// c` with number literals is cheap enough; other loops are where compiled code
+// pays off. The iterations of a parfor have variables of their own, which the
+// interpreter does not model.
+unsigned ForExprAST::interpret_cost() const {
+  auto *start = dyn_cast<NumberExprAST>(Start.get());
+  auto *step = dyn_cast<NumberExprAST>(Step.get());
+  auto *condition = dyn_cast<BinaryExprAST>(Condition.get());
+  if (IsParallel || !start || !step || !(step->get_value() > 0) ||
+      !condition || condition->get_op() != "<" || Body->assigns(VarName))
+    return INTERPRET_COST_LIMIT + 1;
+  auto *variable = dyn_cast<VariableExprAST>(condition->get_lhs());
+  auto *end = dyn_cast<NumberExprAST>(condition->get_rhs());
+  if (!variable || variable->get_name() != VarName || !end)
+    return INTERPRET_COST_LIMIT + 1;
+
+  double trips = std::max(
+      std::ceil((end->get_value() - start->get_value()) / step->get_value()),
+      0.0);
+  unsigned iteration = cap_cost(Condition->interpret_cost() +
+                                Body->interpret_cost() + Step->interpret_cost());
+  if (trips * iteration > INTERPRET_COST_LIMIT)
+    return INTERPRET_COST_LIMIT + 1;
+  return cap_cost(1 + Start->interpret_cost() + Condition->interpret_cost() +
+                  static_cast<unsigned>(trips) * iteration);
+}
+
+std::optional<double> WithExprAST::interpret() {
+  std::vector<std::pair<std::string, std::optional<double>>> old_values;
+
+  auto restore = [&] {
+    for (auto it = old_values.rbegin(); it != old_values.rend(); ++it)
+      if (it->second)
+        InterpretedValues[it->first] = *it->second;
+      else
+        InterpretedValues.erase(it->first);
+  };
+
+  for (auto &[variable_name, init] : Variables) {
+    double initial_val = 0;
+    if (init) {
+      auto val = init->interpret();
+      if (!val) {
+        restore();
+        return std::nullopt;
+      }
+      initial_val = *val;
+    }
+
+    auto old_value = InterpretedValues.find(variable_name);
+    old_values.emplace_back(variable_name,
+                            old_value == InterpretedValues.end()
+                                ? std::nullopt
+                                : std::optional<double>(old_value->second));
+    InterpretedValues[variable_name] = initial_val;
+  }
+
+  auto body = Body->interpret();
+  restore();
+  return body;
+}
+
+unsigned WithExprAST::interpret_cost() const {
+  unsigned cost = 1 + Body->interpret_cost();
+  for (auto &variable : Variables)
+    if (variable.second)
+      cost = cap_cost(cost + variable.second->interpret_cost());
+  return cap_cost(cost);
+}
+
+std::optional<double> FunctionAST::interpret() {
+  InterpretedValues.clear();
+  return Body->interpret();
+}
+
+unsigned FunctionAST::interpret_cost() const { return Body->interpret_cost(); }
@@ -104,6 +104,12 @@ int gettok() {
       return tok_else;
     else if (identifier_str == "for")
       return tok_for;
+    else if (identifier_str == "parfor")
+      return tok_parfor;
+    else if (identifier_str == "reduce")
+      return tok_reduce;
+    else if (identifier_str == "parreduce")
+      return tok_parreduce;
     else if (identifier_str == "do")
       return tok_do;
     else if (identifier_str == "end")
@@ -116,6 +122,12 @@ int gettok() {
       return operator_name.empty() ? tok_identifier : tok_unary;
     } else if (identifier_str == "with")
       return tok_with;
+    else if (identifier_str == "memo")
+      return tok_memo;
+    else if (identifier_str == "const")
+      return tok_const;
+    else if (identifier_str == "pure")
+      return tok_pure;
     return tok_identifier;
   }
 
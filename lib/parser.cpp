@@ -1,9 +1,17 @@
 #include "parser.h"
 #include "ast.h"
+#include "consteval.h"
 #include "internal.h"
 #include "lex.h"
+#include "effects.h"
+#include "external.h"
+#include "inliner.h"
+#include "specializer.h"
+#include "taskqueue.h"
+#include "tiering.h"
 #include <cassert>
 #include <cstring>
+#include <format>
 #include <map>
 #include <memory>
 #include <string>
@@ -13,12 +21,38 @@
 int cur_tok = 0;
 static std::unique_ptr<ExprAST> parse_expression();
 
+#ifndef COMPILATION
+// Top-level expressions are run on EvalQueue in the order they were entered,
+// while CompileQueue compiles new definitions ahead of their first use. The
+// main thread only parses and generates IR, so the REPL keeps accepting input
+// while a long computation runs.
+static TaskQueue EvalQueue;
+static TaskQueue CompileQueue;
+#endif
+
+void wait_for_pending_units() {
+#ifndef COMPILATION
+  EvalQueue.wait();
+  CompileQueue.wait();
+  wait_for_tier_ups();
+#endif
+}
+
 void delete_function_if_exists(const std::string &name) {
   auto rt = FunctionRTs.find(name);
   if (rt != FunctionRTs.end()) {
-    ExitOnErr(rt->second->get()->remove());
+    // Queued units may still run or link against the old definition.
+    wait_for_pending_units();
+    ExitOnErr(rt->second->remove());
     FunctionRTs.erase(rt);
+    kl_memo_release(name.c_str());
+    // The new body may have side effects the old one did not.
+    forget_effects(name);
   }
+  forget_inlined_body(name);
+  // Specializations have the old body substituted.
+  for (auto &spec : forget_specializations(name))
+    delete_function_if_exists(spec);
 }
 
 /// numberexpr ::= number
@@ -70,10 +104,120 @@ static std::unique_ptr<ExprAST> parse_if_expr() {
                                      std::move(else_));
 }
 
+// Operator characters run together into one token, e.g. `]=`; takes the first
+// one off the current operator token.
+static bool eat_operator_char(char c) {
+  if (cur_tok != tok_operator || operator_name.empty() ||
+      operator_name[0] != c)
+    return false;
+  operator_name.erase(0, 1);
+  if (operator_name.empty())
+    get_next_token();
+  return true;
+}
+
+/// hint ::= identifier '=' (number | identifier)
+static bool parse_loop_hint(LoopHints &hints) {
+  if (cur_tok != tok_identifier) {
+    log_error("Expected a loop hint");
+    return false;
+  }
+  auto name = identifier_str;
+  LoopHint *hint = name == "unroll"       ? &hints.Unroll
+                   : name == "vectorize"  ? &hints.Vectorize
+                   : name == "interleave" ? &hints.Interleave
+                                          : nullptr;
+  if (!hint) {
+    log_error(std::format("Unknown loop hint `{}`", name).c_str());
+    return false;
+  }
+  get_next_token(); // eat hint name
+
+  if (!eat_operator_char('=')) {
+    log_error(std::format("Expected `=` after `{}`", name).c_str());
+    return false;
+  }
+
+  bool valid = true;
+  if (cur_tok == tok_number) {
+    valid = num_val >= 1 && num_val <= LOOP_HINT_MAX_COUNT &&
+            num_val == static_cast<unsigned>(num_val);
+    hint->Kind = LoopHint::Count;
+    hint->Value = valid ? num_val : 0;
+    // Vector widths are powers of two.
+    if (hint == &hints.Vectorize && (hint->Value & (hint->Value - 1)))
+      valid = false;
+  } else if (cur_tok == tok_identifier && identifier_str == "enable") {
+    hint->Kind = LoopHint::Enable;
+  } else if (cur_tok == tok_identifier && identifier_str == "disable") {
+    hint->Kind = LoopHint::Disable;
+  } else if (cur_tok == tok_identifier && identifier_str == "full" &&
+             hint == &hints.Unroll) {
+    hint->Kind = LoopHint::Full;
+  } else {
+    valid = false;
+  }
+  if (!valid) {
+    log_error(std::format("Invalid value for loop hint `{}`", name).c_str());
+    return false;
+  }
+  get_next_token(); // eat value
+  return true;
+}
+
+/// hints ::= '[' hint (',' hint)* ']'
+static bool parse_loop_hints(LoopHints &hints) {
+  eat_operator_char('[');
+  while (true) {
+    if (!parse_loop_hint(hints))
+      return false;
+    if (eat_operator_char(']'))
+      return true;
+    if (cur_tok != ',') {
+      log_error("Expected `,` or `]` in loop hints");
+      return false;
+    }
+    get_next_token(); // eat ,
+  }
+}
+
+/// reduceop ::= '+' | '*' | 'min' | 'max'
+static ReduceOp parse_reduce_op() {
+  if (eat_operator_char('+'))
+    return ReduceOp::Add;
+  if (eat_operator_char('*'))
+    return ReduceOp::Mul;
+
+  ReduceOp op = ReduceOp::None;
+  if (cur_tok == tok_identifier && identifier_str == "min")
+    op = ReduceOp::Min;
+  else if (cur_tok == tok_identifier && identifier_str == "max")
+    op = ReduceOp::Max;
+
+  if (op == ReduceOp::None)
+    log_error("Expected `+`, `*`, `min` or `max` after `reduce`");
+  else
+    get_next_token(); // eat min or max
+  return op;
+}
+
+/// forexpr ::= ('for' | 'parfor' | ('reduce' | 'parreduce') reduceop) hints?
+///             identifier '=' expr ',' expr ',' expr 'do' expression 'end'
 static std::unique_ptr<ExprAST> parse_for_expr() {
 
+  bool parallel = cur_tok == tok_parfor || cur_tok == tok_parreduce;
+  bool reduce = cur_tok == tok_reduce || cur_tok == tok_parreduce;
   get_next_token(); // eat for
 
+  auto reduction = ReduceOp::None;
+  if (reduce && (reduction = parse_reduce_op()) == ReduceOp::None)
+    return nullptr;
+
+  LoopHints hints;
+  if (cur_tok == tok_operator && operator_name[0] == '[' &&
+      !parse_loop_hints(hints))
+    return nullptr;
+
   if (cur_tok != tok_identifier)
     return log_error("Expected identifier after `for`");
 
@@ -124,7 +268,8 @@ static std::unique_ptr<ExprAST> parse_for_expr() {
 
   return std::make_unique<ForExprAST>(var, std::move(start),
                                       std::move(condition), std::move(step),
-                                      std::move(body));
+                                      std::move(body), hints, parallel,
+                                      reduction);
 }
 
 static std::unique_ptr<ExprAST> parse_with_expr() {
@@ -174,6 +319,23 @@ static std::unique_ptr<ExprAST> parse_with_expr() {
 /// identifierexpr
 ///   ::= identifier  // simple variable ref
 ///   ::= identifier '(' expression* ')' // function call
+/// indexexpr ::= expr ('[' expression ']')*
+static std::unique_ptr<ExprAST>
+parse_index_expr(std::unique_ptr<ExprAST> array) {
+  while (cur_tok == tok_operator && operator_name[0] == '[') {
+    auto index_loc = cur_loc;
+    eat_operator_char('[');
+    auto index = parse_expression();
+    if (!index)
+      return nullptr;
+    if (!eat_operator_char(']'))
+      return log_error("Expected `]` after index");
+    array = std::make_unique<IndexExprAST>(index_loc, std::move(array),
+                                           std::move(index));
+  }
+  return array;
+}
+
 static std::unique_ptr<ExprAST> parse_identifier_expr() {
   std::string id_name = identifier_str;
   auto fn_call_loc = cur_loc;
@@ -181,7 +343,7 @@ static std::unique_ptr<ExprAST> parse_identifier_expr() {
   get_next_token(); // eat identifier.
 
   if (cur_tok != '(') // Simple variable ref.
-    return std::make_unique<VariableExprAST>(id_name);
+    return parse_index_expr(std::make_unique<VariableExprAST>(id_name));
 
   // Call.
   get_next_token(); // eat (
@@ -205,7 +367,8 @@ static std::unique_ptr<ExprAST> parse_identifier_expr() {
   // Eat the ')'.
   get_next_token();
 
-  return std::make_unique<CallExprAST>(fn_call_loc, id_name, std::move(args));
+  return parse_index_expr(
+      std::make_unique<CallExprAST>(fn_call_loc, id_name, std::move(args)));
 }
 
 /// primary
@@ -223,6 +386,9 @@ static std::unique_ptr<ExprAST> parse_primary() {
   case tok_if:
     return parse_if_expr();
   case tok_for:
+  case tok_parfor:
+  case tok_reduce:
+  case tok_parreduce:
     return parse_for_expr();
   case tok_with:
     return parse_with_expr();
@@ -375,8 +541,12 @@ static std::unique_ptr<PrototypeAST> parse_prototype() {
                                         kind != 0, precedence);
 }
 
-/// definition ::= 'def' prototype expression
+/// definition ::= 'memo'? 'def' prototype expression
 static std::unique_ptr<FunctionAST> parse_definition() {
+  bool is_memo = cur_tok == tok_memo;
+  if (is_memo && get_next_token() != tok_def)
+    return log_error_f("Expected `def` after `memo`");
+
   get_next_token(); // eat def.
   auto proto = parse_prototype();
   if (!proto)
@@ -384,14 +554,22 @@ static std::unique_ptr<FunctionAST> parse_definition() {
 
   delete_function_if_exists(proto->get_name());
   if (auto E = parse_expression())
-    return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
+    return std::make_unique<FunctionAST>(std::move(proto), std::move(E),
+                                         is_memo);
   return nullptr;
 }
 
-/// external ::= 'extern' prototype
+/// external ::= 'extern' 'pure'? prototype
 static std::unique_ptr<PrototypeAST> parse_extern() {
   get_next_token(); // eat extern.
-  return parse_prototype();
+  bool is_pure = cur_tok == tok_pure;
+  if (is_pure)
+    get_next_token(); // eat pure.
+
+  auto proto = parse_prototype();
+  if (proto && is_pure)
+    proto->mark_pure();
+  return proto;
 }
 
 /// toplevelexpr ::= expression
@@ -406,13 +584,87 @@ static std::unique_ptr<FunctionAST> parse_top_level_expression() {
   return nullptr;
 }
 
+/// constant ::= 'const' identifier '=' expression
+static std::unique_ptr<FunctionAST> parse_const(std::string &name) {
+  SourceLocation const_loc = cur_loc;
+  if (get_next_token() != tok_identifier) // eat const.
+    return log_error_f("Expected a name after `const`");
+  name = identifier_str;
+
+  get_next_token(); // eat identifier.
+  if (cur_tok != tok_operator || operator_name != "=")
+    return log_error_f("Expected `=` after the name of a constant");
+  get_next_token(); // eat =.
+
+  if (auto E = parse_expression()) {
+    // The value is computed by an anonymous function of its own.
+    auto proto = std::make_unique<PrototypeAST>(
+        const_loc, std::format("{}.const.{}", ANON_FUNCTION, name),
+        std::vector<std::string>());
+    return std::make_unique<FunctionAST>(std::move(proto), std::move(E));
+  }
+  return nullptr;
+}
+
 // Top level parsing
 //
 //
 
+#ifndef COMPILATION
+// Hands the current module over to the JIT and opens a fresh one for the next
+// unit. The context and pass managers are kept.
+static ResourceTrackerSP add_module_to_jit() {
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  auto TSM = ThreadSafeModule(std::move(TheModule), TheTSC);
+  ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
+  initialize_module_for_jit();
+  return RT;
+}
+
+// Functions that inlined an earlier definition of a callee still run its old
+// body; regenerate them so they pick up the new one.
+static void recompile_stale_inliners(const std::vector<std::string> &names) {
+  for (auto &name : names) {
+    delete_function_if_exists(name);
+    auto lock = TheTSC.getLock();
+    if (rebuild_function(name))
+      FunctionRTs[name] = add_module_to_jit();
+  }
+}
+
+// Hands the definition of `name` in TheModule over to the JIT. Returns the
+// functions that inlined an earlier definition of it.
+static std::vector<std::string> add_definition_to_jit(const std::string &name) {
+  if (BATCH_MODE)
+    return {};
+
+  if (TIERED) {
+    // Tier 0 code is cheap to compile; materialize it right away so the stub
+    // has a target.
+    FunctionRTs[name] = add_tiered_function(name);
+    return {};
+  }
+
+  FunctionRTs[name] = add_module_to_jit();
+
+  CompileQueue.push([name] {
+    if (auto symbol = TheJIT->lookup(name); !symbol)
+      logAllUnhandledErrors(symbol.takeError(), errs(),
+                            std::format("Compiling {}: ", name));
+  });
+
+  if (JIT_INLINING)
+    return stale_inliners(name);
+  return {};
+}
+#endif
+
 void handle_definition() {
+  std::vector<std::string> stale_callers;
   if (auto func = parse_definition()) {
     std::string function_name = func->get_name();
+    // The JIT compiles earlier units on other threads in the same context.
+    auto lock = TheTSC.getLock();
     if (auto *IR = func->codegen()) {
       if (VERBOSE) {
         fprintf(stderr, "Read function definition:\n");
@@ -420,22 +672,116 @@ void handle_definition() {
         fprintf(stderr, "\n");
       }
 #ifndef COMPILATION
-      auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-      auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-      initialize_modules_and_managers_for_jit();
-
-      FunctionRTs[function_name] = &RT;
+      stale_callers = add_definition_to_jit(function_name);
 #endif
     }
   } else {
     // Skip token for error recovery.
     get_next_token();
   }
+
+#ifndef COMPILATION
+  // Waits for queued units, so the context must not be locked any more.
+  recompile_stale_inliners(stale_callers);
+#endif
+}
+
+void handle_loaded_definition(const std::string &name,
+                              function_ref<Function *()> generate) {
+  delete_function_if_exists(name);
+
+  std::vector<std::string> stale_callers;
+  {
+    auto lock = TheTSC.getLock();
+    if (!generate())
+      return;
+#ifndef COMPILATION
+    stale_callers = add_definition_to_jit(name);
+#endif
+  }
+
+#ifndef COMPILATION
+  recompile_stale_inliners(stale_callers);
+#endif
+}
+
+// The whole program is in TheModule (kppc, --run, precompiling a prelude), so
+// the expression is evaluated at compile time.
+static std::optional<double> evaluate_in_module(FunctionAST &expr) {
+  auto lock = TheTSC.getLock();
+  auto *F = expr.codegen();
+  if (!F)
+    return std::nullopt;
+  FunctionProtos.erase(F->getName().str());
+  auto value = evaluate_call(*F, {});
+  TheFAM->clear(*F, F->getName());
+  F->eraseFromParent();
+  return value;
+}
+
+#ifndef COMPILATION
+// Runs a compiled anonymous function, which returns a float under
+// `--precision=single`.
+static double call_anonymous(ExecutorAddr address) {
+  if (SINGLE_PRECISION)
+    return address.toPtr<float (*)()>()();
+  return address.toPtr<double (*)()>()();
+}
+
+// The REPL runs the expression right away, like a top-level expression.
+static std::optional<double> evaluate_in_jit(FunctionAST &expr) {
+  std::string name;
+  ResourceTrackerSP RT;
+  {
+    auto lock = TheTSC.getLock();
+    auto *F = expr.codegen();
+    if (!F)
+      return std::nullopt;
+    name = F->getName().str();
+    FunctionProtos.erase(name);
+    RT = add_module_to_jit();
+  }
+
+  // Compiling the expression locks the context.
+  auto symbol = ExitOnErr(TheJIT->lookup(name));
+  double value = call_anonymous(symbol.getAddress());
+  kl_flush();
+  ExitOnErr(RT->remove());
+  return value;
+}
+#endif
+
+void handle_const() {
+  std::string name;
+  auto expr = parse_const(name);
+  if (!expr) {
+    // Skip token for error recovery.
+    get_next_token();
+    return;
+  }
+
+  unsigned errors = ERROR_COUNT;
+#ifdef COMPILATION
+  auto value = evaluate_in_module(*expr);
+#else
+  auto value = BATCH_MODE ? evaluate_in_module(*expr) : evaluate_in_jit(*expr);
+#endif
+  if (!value) {
+    if (ERROR_COUNT == errors)
+      log_error(
+          std::format("`{}` can not be evaluated at compile time", name)
+              .c_str());
+    return;
+  }
+
+  // Queued top-level expressions may be interpreted, and read Constants.
+  wait_for_pending_units();
+  Constants[name] = *value;
 }
 
 void handle_extern() {
   if (auto ext = parse_extern()) {
+    auto lock = TheTSC.getLock();
     if (auto *extIR = ext->codegen()) {
       if (VERBOSE) {
         fprintf(stderr, "Read a function declaration:\n");
@@ -453,21 +799,52 @@ void handle_extern() {
 void handle_top_level_expression() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto expr = parse_top_level_expression()) {
-    if (expr->codegen()) {
+    if (BATCH_MODE) {
+      log_error("Top-level expressions are not run with --run, call them "
+                "from `main`.");
+      return;
+    }
 
 #ifndef COMPILATION
-      auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-      auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-      ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-      initialize_modules_and_managers_for_jit();
-
-      auto expr_symbol = ExitOnErr(TheJIT->lookup(ANON_FUNCTION));
+    // Cheap expressions that only call known functions are interpreted;
+    // compiling them would cost far more than running them.
+    if (expr->interpret_cost() <= INTERPRET_COST_LIMIT) {
+      std::shared_ptr<FunctionAST> shared_expr = std::move(expr);
+      EvalQueue.push([shared_expr] {
+        auto value = shared_expr->interpret();
+        // What the expression printed comes before its value.
+        kl_flush();
+        if (value)
+          fprintf(stderr,
+                  VERBOSE ? "\r  \tInterpreted to: %lf\n" : "\r  \t%lf\n",
+                  *value);
+      });
+      return;
+    }
+#endif
 
-      auto fp = expr_symbol.getAddress().toPtr<double (*)()>();
+    auto lock = TheTSC.getLock();
+    if (auto *F = expr->codegen()) {
 
-      fprintf(stderr, VERBOSE ? "\r  \tEvaluated to: %lf\n" : "\r  \t%lf\n",
-              fp());
-      ExitOnErr(RT->remove());
+#ifndef COMPILATION
+      // Several expressions can be queued at once, so each one needs its own
+      // symbol.
+      static unsigned anon_count = 0;
+      std::string name = std::format("{}.{}", ANON_FUNCTION, anon_count++);
+      F->setName(name);
+
+      auto RT = add_module_to_jit();
+
+      EvalQueue.push([name, RT] {
+        auto expr_symbol = ExitOnErr(TheJIT->lookup(name));
+
+        double value = call_anonymous(expr_symbol.getAddress());
+        kl_flush();
+        fprintf(stderr,
+                VERBOSE ? "\r  \tEvaluated to: %lf\n" : "\r  \t%lf\n",
+                value);
+        ExitOnErr(RT->remove());
+      });
 #endif
     }
   } else {
@@ -0,0 +1,305 @@
+#include "prelude.h"
+#include "ast.h"
+#include "effects.h"
+#include "internal.h"
+#include "parser.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+struct SourceStamp {
+  uint64_t ModificationTime;
+  uint64_t Size;
+};
+
+struct PrototypeEntry {
+  std::string Name;
+  std::vector<std::string> Args;
+  bool IsOperator;
+  bool IsPure;
+  uint32_t Precedence;
+  uint32_t Line;
+};
+
+struct Prelude {
+  std::vector<PrototypeEntry> Prototypes;
+  std::vector<std::pair<std::string, double>> Constants;
+  StringRef Bitcode; // empty when the prelude only declares functions
+};
+
+class Writer {
+  SmallVectorImpl<char> &Out;
+
+public:
+  Writer(SmallVectorImpl<char> &Out) : Out(Out) {}
+
+  template <typename T> void write(T value) {
+    auto *bytes = reinterpret_cast<const char *>(&value);
+    Out.append(bytes, bytes + sizeof(T));
+  }
+  void write(StringRef bytes) {
+    write<uint32_t>(bytes.size());
+    Out.append(bytes.begin(), bytes.end());
+  }
+};
+
+// Reads the cache in host byte order; it is never shared between machines.
+class Reader {
+  StringRef In;
+  bool Failed = false;
+
+public:
+  Reader(StringRef In) : In(In) {}
+  bool failed() const { return Failed; }
+
+  template <typename T> T read() {
+    T value{};
+    if (In.size() < sizeof(T)) {
+      Failed = true;
+      return value;
+    }
+    std::memcpy(&value, In.data(), sizeof(T));
+    In = In.drop_front(sizeof(T));
+    return value;
+  }
+  StringRef read_bytes(uint64_t size) {
+    if (In.size() < size) {
+      Failed = true;
+      return {};
+    }
+    auto bytes = In.take_front(size);
+    In = In.drop_front(size);
+    return bytes;
+  }
+  std::string read_string() { return read_bytes(read<uint32_t>()).str(); }
+};
+
+} // namespace
+
+static bool parse_prelude(StringRef buffer, const SourceStamp &stamp,
+                          Prelude &prelude) {
+  Reader in(buffer);
+  if (in.read_bytes(4) != KPCH_MAGIC || in.read<uint32_t>() != KPCH_VERSION ||
+      in.read<uint64_t>() != stamp.ModificationTime ||
+      in.read<uint64_t>() != stamp.Size)
+    return false;
+
+  auto count = in.read<uint32_t>();
+  for (uint32_t i = 0; i < count && !in.failed(); ++i) {
+    PrototypeEntry entry;
+    entry.Name = in.read_string();
+    entry.IsOperator = in.read<uint8_t>();
+    entry.IsPure = in.read<uint8_t>();
+    entry.Precedence = in.read<uint32_t>();
+    entry.Line = in.read<uint32_t>();
+    auto args = in.read<uint32_t>();
+    for (uint32_t j = 0; j < args && !in.failed(); ++j)
+      entry.Args.push_back(in.read_string());
+    prelude.Prototypes.push_back(std::move(entry));
+  }
+  auto constants = in.read<uint32_t>();
+  for (uint32_t i = 0; i < constants && !in.failed(); ++i) {
+    auto name = in.read_string();
+    prelude.Constants.emplace_back(name, in.read<double>());
+  }
+  prelude.Bitcode = in.read_bytes(in.read<uint64_t>());
+  return !in.failed();
+}
+
+static void apply_prelude(const Prelude &prelude, const std::string &path) {
+  // Functions are declared in TheModule on first use, see get_function().
+  for (auto &entry : prelude.Prototypes) {
+    auto proto = std::make_unique<PrototypeAST>(
+        SourceLocation{static_cast<int>(entry.Line), 0}, entry.Name,
+        entry.Args, entry.IsOperator, entry.Precedence, entry.IsPure);
+    if (proto->is_binary_op())
+      BINOP_PRECEDENCE[proto->get_operator_name()] = entry.Precedence;
+    // Parsing an `extern pure` declares it pure right away.
+    if (entry.IsPure)
+      declare_pure(entry.Name);
+    FunctionProtos[entry.Name] = std::move(proto);
+  }
+  for (auto &[name, value] : prelude.Constants)
+    Constants[name] = value;
+
+  if (prelude.Bitcode.empty())
+    return;
+
+  std::unique_ptr<Module> library;
+  {
+    auto lock = TheTSC.getLock();
+    library = ExitOnErr(parseBitcodeFile(
+        MemoryBufferRef(prelude.Bitcode, path), *TheContext));
+  }
+  // Each definition becomes a unit of its own, as if it had been parsed: its
+  // callees are declared from their prototypes, with their effects and SIMD
+  // variants, and its name shadows the math intrinsic of the same name.
+  for (auto &F : *library)
+    if (!F.isDeclaration())
+      handle_loaded_definition(F.getName().str(), [&]() -> Function * {
+        for (auto &I : instructions(F))
+          if (auto *call = dyn_cast<CallBase>(&I))
+            if (auto *callee = call->getCalledFunction();
+                callee && callee != &F &&
+                FunctionProtos.count(callee->getName().str()))
+              get_function(callee->getName().str());
+        Definitions.insert(F.getName().str());
+        auto *copy = copy_function_into(F, *TheModule, true);
+        optimize_function(*copy);
+        return copy;
+      });
+
+  auto lock = TheTSC.getLock();
+  library.reset();
+}
+
+// Parses the text of `path` into a module of its own, without handing
+// anything to the JIT, and serializes what it declares and defines. A prelude
+// with errors is not worth caching: they should be reported every time.
+static std::optional<SmallVector<char, 0>>
+precompile(const std::string &path, const SourceStamp &stamp,
+           void (*handle_unit)(), bool &cacheable) {
+  auto source = std::make_unique<std::fstream>(path, std::ios::in);
+  if (!source->is_open())
+    return std::nullopt;
+
+  auto saved_module = std::move(TheModule);
+  auto saved_constants = Constants;
+  std::map<std::string, const PrototypeAST *> saved_protos;
+  for (auto &[name, proto] : FunctionProtos)
+    saved_protos[name] = proto.get();
+  bool saved_batch_mode = BATCH_MODE;
+  unsigned errors = ERROR_COUNT;
+  {
+    auto lock = TheTSC.getLock();
+    TheModule = std::make_unique<Module>(path, *TheContext);
+    TheModule->setDataLayout(saved_module->getDataLayout());
+  }
+  // The cache must not depend on the options of the run that built it, so
+  // preludes are compiled without fast-math, like lib/core.o.
+  auto saved_fast_math = Builder->getFastMathFlags();
+  Builder->clearFastMathFlags();
+  BATCH_MODE = true;
+  set_lex_source(std::move(source));
+  handle_unit();
+  BATCH_MODE = saved_batch_mode;
+  Builder->setFastMathFlags(saved_fast_math);
+
+  SmallVector<char, 0> buffer;
+  Writer out(buffer);
+  buffer.append(KPCH_MAGIC, KPCH_MAGIC + 4);
+  out.write<uint32_t>(KPCH_VERSION);
+  out.write<uint64_t>(stamp.ModificationTime);
+  out.write<uint64_t>(stamp.Size);
+
+  auto lock = TheTSC.getLock();
+  bool has_definitions = false;
+  for (auto &F : *TheModule)
+    has_definitions |= !F.isDeclaration();
+
+  // The prototypes the prelude declared or defined. Function names in the
+  // module may differ from them, e.g. `sinf` for `sin` in single precision.
+  std::vector<const PrototypeAST *> protos;
+  for (auto &[name, proto] : FunctionProtos)
+    if (auto saved = saved_protos.find(name);
+        saved == saved_protos.end() || saved->second != proto.get())
+      protos.push_back(proto.get());
+
+  out.write<uint32_t>(protos.size());
+  for (auto *proto : protos) {
+    out.write(StringRef(proto->get_name()));
+    out.write<uint8_t>(proto->is_operator());
+    out.write<uint8_t>(proto->is_pure());
+    out.write<uint32_t>(proto->get_binary_precedence());
+    out.write<uint32_t>(proto->get_line());
+    out.write<uint32_t>(proto->get_args().size());
+    for (auto &arg : proto->get_args())
+      out.write(StringRef(arg));
+  }
+
+  std::vector<std::pair<std::string, double>> constants;
+  for (auto &[name, value] : Constants)
+    if (auto saved = saved_constants.find(name);
+        saved == saved_constants.end() || saved->second != value)
+      constants.emplace_back(name, value);
+  out.write<uint32_t>(constants.size());
+  for (auto &[name, value] : constants) {
+    out.write(StringRef(name));
+    out.write<double>(value);
+  }
+
+  SmallVector<char, 0> bitcode;
+  if (has_definitions) {
+    raw_svector_ostream os(bitcode);
+    WriteBitcodeToFile(*TheModule, os);
+  }
+  out.write<uint64_t>(bitcode.size());
+  buffer.append(bitcode.begin(), bitcode.end());
+
+  TheModule = std::move(saved_module);
+  cacheable = ERROR_COUNT == errors;
+  return buffer;
+}
+
+// Writes the cache next to the source. Failing to do so only costs time.
+static void write_precompiled(const std::string &kpch_path,
+                              ArrayRef<char> buffer) {
+  auto temp_path = kpch_path + ".tmp";
+  {
+    std::error_code EC;
+    raw_fd_ostream out(temp_path, EC, sys::fs::OF_None);
+    if (EC)
+      return;
+    out.write(buffer.data(), buffer.size());
+    if (out.has_error()) {
+      out.clear_error();
+      sys::fs::remove(temp_path);
+      return;
+    }
+  }
+  if (sys::fs::rename(temp_path, kpch_path))
+    sys::fs::remove(temp_path);
+}
+
+bool load_prelude(const std::string &path, void (*handle_unit)()) {
+  sys::fs::file_status status;
+  if (sys::fs::status(path, status) || !sys::fs::is_regular_file(status)) {
+    fprintf(stderr, "Could not open file %s\n", path.c_str());
+    return false;
+  }
+  SourceStamp stamp{static_cast<uint64_t>(
+                        status.getLastModificationTime().time_since_epoch()
+                            .count()),
+                    status.getSize()};
+
+  // Single-precision code has its own cache.
+  auto kpch_path = path + (SINGLE_PRECISION ? ".f32" : "") + KPCH_SUFFIX;
+  if (auto buffer = MemoryBuffer::getFile(kpch_path, /*IsText=*/false,
+                                          /*RequiresNullTerminator=*/false)) {
+    Prelude prelude;
+    if (parse_prelude((*buffer)->getBuffer(), stamp, prelude)) {
+      apply_prelude(prelude, kpch_path);
+      return true;
+    }
+  }
+
+  bool cacheable = false;
+  auto buffer = precompile(path, stamp, handle_unit, cacheable);
+  if (!buffer) {
+    fprintf(stderr, "Could not open file %s\n", path.c_str());
+    return false;
+  }
+  if (cacheable)
+    write_precompiled(kpch_path, *buffer);
+
+  Prelude prelude;
+  parse_prelude(StringRef(buffer->data(), buffer->size()), stamp, prelude);
+  apply_prelude(prelude, kpch_path);
+  return true;
+}
@@ -0,0 +1,118 @@
+#include "simd.h"
+#include "effects.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/IR/Attributes.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <format>
+
+static constexpr unsigned Lanes[] = {2, 4, 8};
+
+static bool has_variants(const Function &F) {
+  return F.arg_size() > 0 && F.getName() != "main" &&
+         !F.getName().starts_with(ANON_FUNCTION) &&
+         !F.hasLocalLinkage() && !is_math_function(F.getName().str());
+}
+
+static std::string variant_name(const Function &F, unsigned lanes) {
+  return std::format("{}.simd{}", F.getName().str(), lanes);
+}
+
+// Declares the variant and, if `advertise`, names it in the attribute of F,
+// e.g. `_ZGV_LLVM_N4vv_f(f.simd4)`: no mask, 4 lanes, two vector parameters.
+static Function *declare_variant(Function &F, unsigned lanes,
+                                 bool advertise = true) {
+  auto *M = F.getParent();
+  auto *vector_ty = FixedVectorType::get(F.getReturnType(), lanes);
+  auto *FT = FunctionType::get(
+      vector_ty, SmallVector<Type *, 4>(F.arg_size(), vector_ty), false);
+  auto name = variant_name(F, lanes);
+
+  auto *variant = M->getFunction(name);
+  if (!variant)
+    variant = Function::Create(FT, Function::ExternalLinkage, name, M);
+  // The variants behave like the scalar function, lane by lane.
+  variant->setAttributes(AttributeList::get(
+      F.getContext(), F.getAttributes().getFnAttrs(), {}, {}));
+  variant->removeFnAttr("vector-function-abi-variant");
+  if (!advertise)
+    return variant;
+
+  auto abi_name =
+      std::format("_ZGV_LLVM_N{}{}_{}({})", lanes,
+                  std::string(F.arg_size(), 'v'), F.getName().str(), name);
+  auto attribute = F.getFnAttribute("vector-function-abi-variant");
+  auto names = attribute.isValid() ? attribute.getValueAsString().str() : "";
+  if (names.find(abi_name) == std::string::npos)
+    F.addFnAttr("vector-function-abi-variant",
+                names.empty() ? abi_name : names + "," + abi_name);
+  return variant;
+}
+
+void declare_simd_variants(Function &F) {
+  if (!has_variants(F))
+    return;
+  // Declarations nobody calls yet must survive until the vectorizer runs.
+  SmallVector<GlobalValue *, 3> variants;
+  for (auto lanes : Lanes)
+    variants.push_back(declare_variant(F, lanes));
+  appendToCompilerUsed(*F.getParent(), variants);
+}
+
+// Whether the SLP vectorizer can pack the lanes of F's body: it has no loops,
+// and calls nothing but intrinsics that have vector forms.
+static bool is_packable(const Function &F) {
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 1> backedges;
+  FindFunctionBackedges(F, backedges);
+  if (!backedges.empty())
+    return false;
+  for (auto &I : instructions(F))
+    if (auto *call = dyn_cast<CallBase>(&I);
+        call && !isTriviallyVectorizable(call->getIntrinsicID()))
+      return false;
+  return true;
+}
+
+// variant(x, y) = [F(x[0], y[0]), ..., F(x[n-1], y[n-1])], with the calls
+// inlined if `inline_lanes`.
+static void define_variant(Function &F, Function &variant, unsigned lanes,
+                           bool inline_lanes) {
+  variant.deleteBody();
+  IRBuilder<> builder(BasicBlock::Create(F.getContext(), "entry", &variant));
+
+  SmallVector<CallInst *, 8> calls;
+  Value *result = PoisonValue::get(variant.getReturnType());
+  for (unsigned lane = 0; lane < lanes; ++lane) {
+    SmallVector<Value *, 4> args;
+    for (auto &arg : variant.args())
+      args.push_back(builder.CreateExtractElement(&arg, lane));
+    auto *call = builder.CreateCall(&F, args);
+    calls.push_back(call);
+    result = builder.CreateInsertElement(result, call, lane);
+  }
+  builder.CreateRet(result);
+
+  // A redefinition replaces the body.
+  TheFAM->clear(variant, variant.getName());
+  if (!inline_lanes)
+    return;
+  for (auto *call : calls) {
+    InlineFunctionInfo IFI;
+    InlineFunction(*call, IFI);
+  }
+  TheFPM->run(variant, *TheFAM);
+}
+
+// The lanes of a body with loops or other calls would run one after the
+// other, no faster than calling F in a loop, so the vectorizer is not told
+// about its variants. They are still defined for the `extern pure`
+// declarations of other units.
+void add_simd_variants(Function &F) {
+  if (!has_variants(F) || !F.doesNotAccessMemory() || !F.doesNotThrow())
+    return;
+  bool packable = is_packable(F);
+  for (auto lanes : Lanes)
+    define_variant(F, *declare_variant(F, lanes, packable), lanes, packable);
+}
@@ -0,0 +1,213 @@
+#include "specializer.h"
+#include "ast.h"
+#include "effects.h"
+#include "inliner.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <algorithm>
+#include <format>
+#include <map>
+#include <optional>
+
+// The constant argument of every parameter, null where it is not constant.
+using ArgTuple = std::vector<ConstantFP *>;
+
+static std::optional<ArgTuple> constant_arguments(const CallInst &call) {
+  ArgTuple tuple;
+  for (auto &arg : call.args())
+    tuple.push_back(dyn_cast<ConstantFP>(arg));
+  if (std::all_of(tuple.begin(), tuple.end(), [](auto *C) { return !C; }))
+    return std::nullopt;
+  return tuple;
+}
+
+static bool can_specialize(const Function &F) {
+  return !F.isDeclaration() && !F.isVarArg() && F.getName() != "main" &&
+         F.getInstructionCount() <= SPECIALIZE_SIZE_LIMIT;
+}
+
+static FunctionType *specialized_type(const Function &F,
+                                      const ArgTuple &tuple) {
+  std::vector<Type *> params;
+  for (auto [arg, value] : zip(F.args(), tuple))
+    if (!value)
+      params.push_back(arg.getType());
+  return FunctionType::get(F.getReturnType(), params, false);
+}
+
+// Copies F into its module with the constants substituted; the copy only
+// takes the remaining parameters. musttail needs the caller to have the
+// callee's prototype, which the copy no longer has, so its tail calls become
+// plain ones.
+static Function *clone_with_constants(Function &F, const ArgTuple &tuple,
+                                      const std::string &name) {
+  ValueToValueMapTy VMap;
+  for (auto [arg, value] : zip(F.args(), tuple))
+    if (value)
+      VMap[&arg] = value;
+  auto *spec = CloneFunction(&F, VMap);
+  spec->setName(name);
+  for (auto &I : instructions(*spec))
+    if (auto *call = dyn_cast<CallInst>(&I); call && call->isMustTailCall())
+      call->setTailCallKind(CallInst::TCK_Tail);
+  return spec;
+}
+
+static void redirect_call(CallInst *call, FunctionCallee spec,
+                          const ArgTuple &tuple) {
+  std::vector<Value *> args;
+  for (auto [arg, value] : zip(call->args(), tuple))
+    if (!value)
+      args.push_back(arg);
+
+  auto *new_call = CallInst::Create(spec, args, "", call);
+  new_call->setDebugLoc(call->getDebugLoc());
+  // musttail needs identical prototypes, which the specialization lacks.
+  new_call->setTailCallKind(call->getTailCallKind() == CallInst::TCK_MustTail
+                                ? CallInst::TCK_Tail
+                                : call->getTailCallKind());
+  new_call->takeName(call);
+  call->replaceAllUsesWith(new_call);
+  call->eraseFromParent();
+}
+
+// JIT
+//
+// Callee name -> constant arguments -> name of the specialization
+
+static std::map<std::string, std::map<ArgTuple, std::string>> Specializations;
+
+static std::optional<std::string> get_specialization(const std::string &name,
+                                                     const ArgTuple &tuple) {
+  auto &variants = Specializations[name];
+  if (auto variant = variants.find(tuple); variant != variants.end())
+    return variant->second;
+
+  auto *pristine = pristine_copy(name);
+  if (variants.size() >= SPECIALIZE_MAX_VARIANTS || !pristine ||
+      !can_specialize(*pristine))
+    return std::nullopt;
+
+  auto spec_name = std::format("{}.spec{}", name, variants.size());
+  auto M = std::make_unique<Module>(spec_name, *TheContext);
+  M->setDataLayout(pristine->getParent()->getDataLayout());
+  auto *general = copy_function_into(*pristine, *M);
+  auto *spec = clone_with_constants(*general, tuple, spec_name);
+  // Recursive calls with the same constants find the specialization itself.
+  general->deleteBody();
+  // The call keeps going to the general function if the copy is broken.
+  if (verifyFunction(*spec, &errs()))
+    return std::nullopt;
+  variants[tuple] = spec_name;
+
+  optimize_function(*spec);
+  depend_on(*spec, name);
+
+  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+  ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(M), TheTSC), RT));
+  FunctionRTs[spec_name] = RT;
+  return spec_name;
+}
+
+void specialize_constant_calls(Function &F) {
+  std::vector<CallInst *> calls;
+  for (auto &I : instructions(F))
+    if (auto *call = dyn_cast<CallInst>(&I))
+      if (auto *callee = call->getCalledFunction();
+          callee && callee->isDeclaration())
+        calls.push_back(call);
+
+  for (auto *call : calls) {
+    auto *callee = call->getCalledFunction();
+    auto tuple = constant_arguments(*call);
+    if (!tuple)
+      continue;
+    auto name = callee->getName().str();
+    auto spec_name = get_specialization(name, *tuple);
+    if (!spec_name)
+      continue;
+
+    auto *M = F.getParent();
+    bool declared = M->getFunction(*spec_name);
+    auto spec = M->getOrInsertFunction(*spec_name,
+                                       specialized_type(*callee, *tuple));
+    if (!declared)
+      apply_known_effects(*cast<Function>(spec.getCallee()));
+    redirect_call(call, spec, *tuple);
+
+    depend_on(F, name);
+    depend_on(F, *spec_name);
+  }
+}
+
+std::vector<std::string> forget_specializations(const std::string &name) {
+  std::vector<std::string> names;
+  auto variants = Specializations.find(name);
+  if (variants == Specializations.end())
+    return names;
+
+  for (auto &[tuple, spec_name] : variants->second) {
+    // The specialization has the old body, it must not be rebuilt.
+    forget_function(spec_name);
+    names.push_back(spec_name);
+  }
+  Specializations.erase(variants);
+  return names;
+}
+
+// Whole module
+//
+
+std::vector<Function *> specialize_constant_calls(Module &M) {
+  std::map<std::pair<Function *, ArgTuple>, Function *> specializations;
+  std::map<Function *, unsigned> variants;
+  std::vector<Function *> created;
+
+  std::vector<Function *> pending;
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      pending.push_back(&F);
+
+  // New specializations may call their callees with constants again, e.g. in
+  // recursion, so they are scanned in turn.
+  while (!pending.empty()) {
+    std::map<std::pair<Function *, ArgTuple>, std::vector<CallInst *>> sites;
+    for (auto *F : pending)
+      for (auto &I : instructions(*F))
+        if (auto *call = dyn_cast<CallInst>(&I))
+          if (auto *callee = call->getCalledFunction();
+              callee && can_specialize(*callee))
+            if (auto tuple = constant_arguments(*call))
+              sites[{callee, *tuple}].push_back(call);
+    pending.clear();
+
+    // The most frequent constant arguments get the budget first.
+    std::vector<decltype(sites)::value_type *> ranked;
+    for (auto &site : sites)
+      ranked.push_back(&site);
+    std::stable_sort(ranked.begin(), ranked.end(), [](auto *a, auto *b) {
+      return a->second.size() > b->second.size();
+    });
+
+    for (auto *site : ranked) {
+      auto &[key, calls] = *site;
+      auto &[callee, tuple] = key;
+      auto &spec = specializations[key];
+      if (!spec) {
+        if (variants[callee] >= SPECIALIZE_MAX_VARIANTS)
+          continue;
+        spec = clone_with_constants(
+            *callee, tuple,
+            std::format("{}.spec{}", callee->getName().str(),
+                        variants[callee]++));
+        spec->setLinkage(GlobalValue::InternalLinkage);
+        created.push_back(spec);
+        pending.push_back(spec);
+      }
+      for (auto *call : calls)
+        redirect_call(call, spec, tuple);
+    }
+  }
+  return created;
+}
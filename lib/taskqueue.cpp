@@ -0,0 +1,53 @@
+#include "taskqueue.h"
+
+TaskQueue::~TaskQueue() {
+  {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Stopping = true;
+  }
+  Cond.notify_all();
+  if (!Worker)
+    return;
+
+  // A task may end the process (e.g. through ExitOnErr); the worker can not
+  // join itself then.
+  if (std::this_thread::get_id() == WorkerId)
+    Worker->detach();
+  else
+    Worker->join();
+}
+
+void TaskQueue::push(std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(Mutex);
+  if (!Worker)
+    Worker.emplace(std::optional<unsigned>(TASK_STACK_SIZE), [this] { run(); });
+  Tasks.push_back(std::move(task));
+  Cond.notify_all();
+}
+
+void TaskQueue::wait() {
+  std::unique_lock<std::mutex> lock(Mutex);
+  Cond.wait(lock, [this] { return Tasks.empty() && !Busy; });
+}
+
+void TaskQueue::run() {
+  std::unique_lock<std::mutex> lock(Mutex);
+  WorkerId = std::this_thread::get_id();
+  while (true) {
+    Cond.wait(lock, [this] { return Stopping || !Tasks.empty(); });
+    // Pending tasks are still run when stopping.
+    if (Tasks.empty())
+      return;
+
+    auto task = std::move(Tasks.front());
+    Tasks.pop_front();
+    Busy = true;
+
+    lock.unlock();
+    task();
+    lock.lock();
+
+    Busy = false;
+    Cond.notify_all();
+  }
+}
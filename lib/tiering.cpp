@@ -0,0 +1,230 @@
+#include "tiering.h"
+#include "ast.h"
+#include "taskqueue.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Host.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <atomic>
+#include <format>
+#include <mutex>
+
+uint64_t TIER_ENTRY_THRESHOLD = 1000;
+uint64_t TIER_BACKEDGE_THRESHOLD = 100000;
+
+struct TierProfile {
+  std::string Name;
+  std::atomic<uint64_t> Entries = 0;
+  std::atomic<uint64_t> Backedges = 0;
+  std::atomic<unsigned> Tier = 0;
+  std::atomic<bool> Queued = false;
+
+  // Uninstrumented copy of the definition for the O3 recompile.
+  ThreadSafeModule Clean;
+  ResourceTrackerSP RT;
+};
+
+static std::mutex ProfilesMutex;
+static std::map<std::string, std::unique_ptr<TierProfile>> Profiles;
+static std::unique_ptr<IndirectStubsManager> Stubs;
+static TaskQueue TierQueue;
+
+// Tier 1 compiles on the one thread of TierQueue, which owns this machine;
+// TheTargetMachine belongs to the main thread.
+static std::unique_ptr<TargetMachine> Tier1TargetMachine;
+
+static void optimize_for_tier1(Module &M) {
+  if (!Tier1TargetMachine)
+    Tier1TargetMachine = ExitOnErr(
+        ExitOnErr(JITTargetMachineBuilder::detectHost()).createTargetMachine());
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PassBuilder PB(Tier1TargetMachine.get());
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3).run(M, MAM);
+}
+
+static void promote(TierProfile &P) {
+  auto tier1_name = std::format("{}.t1", P.Name);
+  P.Clean.withModuleDo([&](Module &M) {
+    // Self-recursive calls keep calling the optimized body directly.
+    M.getFunction(P.Name)->setName(tier1_name);
+    optimize_for_tier1(M);
+  });
+
+  ExitOnErr(TheJIT->addModule(std::move(P.Clean), P.RT));
+  auto symbol = ExitOnErr(TheJIT->lookup(tier1_name));
+  ExitOnErr(Stubs->updatePointer(P.Name, symbol.getAddress()));
+  P.Tier = 1;
+
+  fprintf(stderr, "\r  \t[tier] %s -> tier 1 (%llu calls, %llu back-edges)\n",
+          P.Name.c_str(), static_cast<unsigned long long>(P.Entries.load()),
+          static_cast<unsigned long long>(P.Backedges.load()));
+}
+
+// Called from tier 0 code, as kl_tier_up, when one of its counters reaches
+// the threshold.
+static void request_tier_up(TierProfile *P) {
+  if (P->Queued.exchange(true))
+    return;
+  TierQueue.push([P] { promote(*P); });
+}
+
+// Tier 0 code reaches the profile of `name` through symbols that
+// add_tiered_function defines, e.g. `f.tier.entries` for its entry counter.
+static std::string profile_symbol(const std::string &name, const char *part) {
+  return std::format("{}.tier.{}", name, part);
+}
+
+static Constant *declare_profile_symbol(Module &M, const std::string &name,
+                                        const char *part) {
+  return M.getOrInsertGlobal(profile_symbol(name, part),
+                             Type::getInt64Ty(M.getContext()));
+}
+
+// counter += 1, and ask for a recompile when it reaches the threshold.
+static void insert_counter(Instruction *before, const char *counter,
+                           uint64_t threshold, const std::string &name) {
+  auto &M = *before->getModule();
+  IRBuilder<> B(before);
+  auto *old = B.CreateAtomicRMW(
+      AtomicRMWInst::Add, declare_profile_symbol(M, name, counter),
+      B.getInt64(1), MaybeAlign(8), AtomicOrdering::Monotonic);
+  auto *hot = B.CreateICmpEQ(old, B.getInt64(threshold - 1));
+
+  auto *then_inst = SplitBlockAndInsertIfThen(hot, before, false);
+  IRBuilder<> TB(then_inst);
+  auto tier_up = M.getOrInsertFunction("kl_tier_up", TB.getVoidTy(),
+                                       TB.getPtrTy());
+  TB.CreateCall(tier_up, {declare_profile_symbol(M, name, "profile")});
+}
+
+static void instrument(Function &F, const std::string &name) {
+  std::vector<BasicBlock *> latches;
+  auto &LI = TheFAM->getResult<LoopAnalysis>(F);
+  for (auto *L : LI.getLoopsInPreorder()) {
+    SmallVector<BasicBlock *, 4> loop_latches;
+    L->getLoopLatches(loop_latches);
+    latches.insert(latches.end(), loop_latches.begin(), loop_latches.end());
+  }
+
+  for (auto *latch : latches)
+    insert_counter(latch->getTerminator(), "backedges",
+                   TIER_BACKEDGE_THRESHOLD, name);
+  insert_counter(&*F.getEntryBlock().getFirstInsertionPt(), "entries",
+                 TIER_ENTRY_THRESHOLD, name);
+  // The counters are memory the function now writes.
+  F.removeFnAttr(Attribute::Memory);
+  F.removeFnAttr(Attribute::Speculatable);
+}
+
+ResourceTrackerSP add_tiered_function(const std::string &name) {
+  if (!Stubs)
+    Stubs = createLocalIndirectStubsManagerBuilder(
+        Triple(sys::getProcessTriple()))();
+
+  auto P = std::make_unique<TierProfile>();
+  P->Name = name;
+  P->RT = TheJIT->getMainJITDylib().createResourceTracker();
+
+  // The clean copy defines the function, the outlined bodies of its parfor
+  // loops, where a parallel kernel spends its time, and the module's local
+  // constants. The bodies become internal so they do not clash with their
+  // tier 0 versions. Everything else the unit defines is declared and linked
+  // against the tier 0 module, which stays in the same JITDylib.
+  auto *F = TheModule->getFunction(name);
+  auto outlined_prefix = std::format("{}.parfor", name);
+  auto is_outlined = [&](const GlobalValue *GV) {
+    return isa<Function>(GV) && GV->getName().starts_with(outlined_prefix);
+  };
+  ValueToValueMapTy VMap;
+  auto clean = CloneModule(*TheModule, VMap, [&](const GlobalValue *GV) {
+    return GV == F || GV->hasLocalLinkage() || is_outlined(GV);
+  });
+  for (auto &body : *clean)
+    if (is_outlined(&body))
+      body.setLinkage(GlobalValue::InternalLinkage);
+  P->Clean = ThreadSafeModule(std::move(clean), TheTSC);
+
+  // Tier 0 lives under its own name; every call, including recursive ones,
+  // goes through the stub that carries the function's name.
+  auto tier0_name = std::format("{}.t0", name);
+  F->setName(tier0_name);
+  auto *stub_decl = Function::Create(F->getFunctionType(),
+                                     Function::ExternalLinkage, name,
+                                     TheModule.get());
+  F->replaceAllUsesWith(stub_decl);
+  instrument(*F, name);
+
+  // The profile goes with the code, so a redefinition starts a new one.
+  auto define_profile_symbol = [&](const char *part, void *address) {
+    ExitOnErr(TheJIT->defineAbsolute(
+        profile_symbol(name, part),
+        ExecutorSymbolDef(ExecutorAddr::fromPtr(address),
+                          JITSymbolFlags::Exported),
+        P->RT));
+  };
+  define_profile_symbol("entries", &P->Entries);
+  define_profile_symbol("backedges", &P->Backedges);
+  define_profile_symbol("profile", P.get());
+
+  // The stub outlives redefinitions, so code that already calls it picks up
+  // the new body.
+  bool new_stub = !Stubs->findStub(name, false).getAddress();
+  if (new_stub) {
+    auto flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    ExitOnErr(Stubs->createStub(name, ExecutorAddr(), flags));
+    ExitOnErr(TheJIT->defineAbsolute(name, Stubs->findStub(name, false)));
+  }
+
+  ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), TheTSC),
+                              P->RT));
+  initialize_module_for_jit();
+
+  auto symbol = ExitOnErr(TheJIT->lookup(tier0_name));
+  ExitOnErr(Stubs->updatePointer(name, symbol.getAddress()));
+
+  auto RT = P->RT;
+  std::lock_guard<std::mutex> lock(ProfilesMutex);
+  Profiles[name] = std::move(P);
+  return RT;
+}
+
+static double print_tiers() {
+  std::lock_guard<std::mutex> lock(ProfilesMutex);
+  for (auto &[name, P] : Profiles)
+    fprintf(stderr, "\r  \t%-24s tier %u  %12llu calls  %12llu back-edges\n",
+            name.c_str(), P->Tier.load(),
+            static_cast<unsigned long long>(P->Entries.load()),
+            static_cast<unsigned long long>(P->Backedges.load()));
+  return 0;
+}
+
+void declare_tier_builtins() {
+  ExitOnErr(TheJIT->defineAbsolute(
+      "kl_tier_up",
+      ExecutorSymbolDef(ExecutorAddr::fromPtr(&request_tier_up),
+                        JITSymbolFlags::Exported | JITSymbolFlags::Callable)));
+  ExitOnErr(TheJIT->defineAbsolute(
+      "tiers", ExecutorSymbolDef(ExecutorAddr::fromPtr(&print_tiers),
+                                 JITSymbolFlags::Exported |
+                                     JITSymbolFlags::Callable)));
+  FunctionProtos["tiers"] = std::make_unique<PrototypeAST>(
+      SourceLocation{0, 0}, "tiers", std::vector<std::string>());
+}
+
+void wait_for_tier_ups() { TierQueue.wait(); }
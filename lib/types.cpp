@@ -0,0 +1,188 @@
+#include "ast.h"
+#include "internal.h"
+#include <algorithm>
+#include <cmath>
+
+// Every Kl++ value is a number, but many are only ever integers: loop
+// counters, indices, the results of comparisons. Codegen keeps those out of
+// floating point where it can show they stay in the range a number holds
+// exactly.
+
+std::map<const AllocaInst *, double> IntegerBounds;
+
+// Integers up to 2^53 (2^24 for floats) are exact, so integer and floating
+// point arithmetic on them agree as long as no result leaves that range.
+static double get_exact_limit() { return SINGLE_PRECISION ? 0x1p24 : 0x1p53; }
+
+static std::optional<double> get_exact_bound(double value) {
+  if (std::trunc(value) != value || std::fabs(value) > get_exact_limit())
+    return std::nullopt;
+  return std::fabs(value);
+}
+
+std::optional<double> NumberExprAST::get_integer_bound() const {
+  return get_exact_bound(Val);
+}
+
+bool NumberExprAST::assigns(const std::string &) const { return false; }
+
+// Integer variables are the allocas codegen gave an integer type, with the
+// bound it recorded for them; `const` names are their value.
+std::optional<double> VariableExprAST::get_integer_bound() const {
+  auto variable = NamedValues.find(Name);
+  if (variable == NamedValues.end() || !variable->second) {
+    auto constant = Constants.find(Name);
+    if (constant == Constants.end())
+      return std::nullopt;
+    return get_exact_bound(constant->second);
+  }
+  auto bound = IntegerBounds.find(variable->second);
+  if (bound == IntegerBounds.end() ||
+      !variable->second->getAllocatedType()->isIntegerTy())
+    return std::nullopt;
+  return bound->second;
+}
+
+bool VariableExprAST::assigns(const std::string &) const { return false; }
+
+// A sum is only an integer if it can not leave the exact range. Products
+// would leave it far sooner; they stay in floating point.
+std::optional<double> BinaryExprAST::get_integer_bound() const {
+  if (Op != "+" && Op != "-")
+    return std::nullopt;
+  auto lhs = LHS->get_integer_bound();
+  auto rhs = RHS->get_integer_bound();
+  if (!lhs || !rhs || *lhs + *rhs > get_exact_limit())
+    return std::nullopt;
+  return *lhs + *rhs;
+}
+
+// Whether an expression with an integer bound, i.e. made of numbers,
+// variables, `+` and `-`, reads the variable `name`.
+static bool reads(const ExprAST *expr, const std::string &name) {
+  if (auto *variable = dyn_cast<VariableExprAST>(expr))
+    return variable->get_name() == name;
+  if (auto *binary = dyn_cast<BinaryExprAST>(expr))
+    return reads(binary->get_lhs(), name) || reads(binary->get_rhs(), name);
+  return false;
+}
+
+// The variable of `for i = start, i < end, step` with a positive number as
+// the step, or of `i > end` with a negative one, stays between start and end
+// in the body and passes the end by less than a step at the exit test. When
+// start is a bounded integer, nothing assigns to the variable and the end does
+// not depend on it, this returns the end.
+ExprAST *ForExprAST::get_counter_end() const {
+  auto *step = dyn_cast<NumberExprAST>(Step.get());
+  auto *condition = dyn_cast<BinaryExprAST>(Condition.get());
+  if (!step || !condition || Condition->assigns(VarName) ||
+      Step->assigns(VarName) || Body->assigns(VarName) ||
+      !Start->is_integer() || !Step->is_integer())
+    return nullptr;
+
+  // The variable is on the left of `<` or on the right of `>` when it counts
+  // up, the other way round when it counts down.
+  bool up = step->get_value() > 0;
+  if (!up && !(step->get_value() < 0))
+    return nullptr;
+  bool left = (condition->get_op() == "<") == up;
+  if (condition->get_op() != "<" && condition->get_op() != ">")
+    return nullptr;
+  auto *variable = dyn_cast<VariableExprAST>(left ? condition->get_lhs()
+                                                  : condition->get_rhs());
+  auto *end = left ? condition->get_rhs() : condition->get_lhs();
+  if (!variable || variable->get_name() != VarName || reads(end, VarName))
+    return nullptr;
+  return end;
+}
+
+// With a bounded integer end, the variable is an integer in every iteration.
+std::optional<double> ForExprAST::get_counter_bound() const {
+  auto *end = get_counter_end();
+  if (!end)
+    return std::nullopt;
+  auto end_bound = end->get_integer_bound();
+  if (!end_bound)
+    return std::nullopt;
+  double bound = std::max(*Start->get_integer_bound(),
+                          *end_bound + *Step->get_integer_bound());
+  if (bound > get_exact_limit())
+    return std::nullopt;
+  return bound;
+}
+
+// Whether `expr` has the same value in every iteration of a loop that assigns
+// to none of `loop`'s variables: it only reads numbers and variables, and
+// computes with `+`, `-` and `*`.
+static bool is_invariant(const ExprAST *expr,
+                         function_ref<bool(const std::string &)> assigned) {
+  if (isa<NumberExprAST>(expr))
+    return true;
+  if (auto *variable = dyn_cast<VariableExprAST>(expr))
+    return !assigned(variable->get_name());
+  if (auto *binary = dyn_cast<BinaryExprAST>(expr))
+    return (binary->get_op() == "+" || binary->get_op() == "-" ||
+            binary->get_op() == "*") &&
+           is_invariant(binary->get_lhs(), assigned) &&
+           is_invariant(binary->get_rhs(), assigned);
+  return false;
+}
+
+// Any other end the loop does not change, such as a parameter, is checked
+// once before the loop. Within the limit, the variable stays in the exact
+// range.
+std::optional<ForExprAST::CheckedEnd> ForExprAST::get_checked_end() const {
+  auto *end = get_counter_end();
+  auto assigned = [&](const std::string &name) {
+    return name == VarName || Condition->assigns(name) ||
+           Step->assigns(name) || Body->assigns(name);
+  };
+  if (!end || !is_invariant(end, assigned))
+    return std::nullopt;
+
+  double step = cast<NumberExprAST>(Step.get())->get_value();
+  return CheckedEnd{end, get_exact_limit() - std::fabs(step), std::fabs(step),
+                    step > 0};
+}
+
+bool BinaryExprAST::assigns(const std::string &name) const {
+  if (Op == "=")
+    if (auto *variable = dyn_cast<VariableExprAST>(LHS.get());
+        variable && variable->get_name() == name)
+      return true;
+  return LHS->assigns(name) || RHS->assigns(name);
+}
+
+bool UnaryExprAST::assigns(const std::string &name) const {
+  return Operand->assigns(name);
+}
+
+bool CallExprAST::assigns(const std::string &name) const {
+  for (auto &arg : Args)
+    if (arg->assigns(name))
+      return true;
+  return false;
+}
+
+bool IndexExprAST::assigns(const std::string &name) const {
+  return Array->assigns(name) || Index->assigns(name);
+}
+
+bool IfExprAST::assigns(const std::string &name) const {
+  return Condition->assigns(name) || Then->assigns(name) ||
+         Else->assigns(name);
+}
+
+// Shadowing is ignored: an assignment to an inner variable of the same name
+// only makes the answer conservative.
+bool ForExprAST::assigns(const std::string &name) const {
+  return Start->assigns(name) || Condition->assigns(name) ||
+         Step->assigns(name) || Body->assigns(name);
+}
+
+bool WithExprAST::assigns(const std::string &name) const {
+  for (auto &[variable, init] : Variables)
+    if (init && init->assigns(name))
+      return true;
+  return Body->assigns(name);
+}
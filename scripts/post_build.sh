@@ -6,6 +6,10 @@ set -euo pipefail
 mv output.s lib/core.s
 ./kppc < lib/builtin.kl
 mv output.s lib/builtin.s
+./kppc --precision=single < lib/core.kl
+mv output.s lib/core32.s
+./kppc --precision=single < lib/builtin.kl
+mv output.s lib/builtin32.s
 cd lib
-${CMAKE_CXX_COMPILER} -c core.s builtin.s
+${CMAKE_CXX_COMPILER} -c core.s builtin.s core32.s builtin32.s
 rm -r *.s
@@ -2,13 +2,15 @@
 #include "internal.h"
 #include "lex.h"
 #include "parser.h"
+#include "prelude.h"
+#include "specializer.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/Support/CodeGen.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/TargetParser/Host.h"
 #include <cstdio>
-#include <fstream>
+#include <cstring>
 #include <sstream>
 
 using namespace llvm;
@@ -32,7 +34,7 @@ int get_unit(std::stringstream &ss) {
   return 0;
 }
 
-/// top ::= definition | external | expression | ';'
+/// top ::= definition | external | constant | expression | ';'
 static void handle_unit() {
   get_next_token();
   while (true) {
@@ -43,11 +45,15 @@ static void handle_unit() {
       get_next_token();
       break;
     case tok_def:
+    case tok_memo:
       handle_definition();
       break;
     case tok_extern:
       handle_extern();
       break;
+    case tok_const:
+      handle_const();
+      break;
     default:
       handle_top_level_expression();
       break;
@@ -55,7 +61,17 @@ static void handle_unit() {
   }
 }
 
-int main() {
+int main(int argc, char **argv) {
+  // --emit-llvm: print the optimized module instead of writing output.s
+  bool emit_llvm = false;
+  for (int i = 1; i < argc; ++i)
+    if (std::strcmp(argv[i], "--emit-llvm") == 0)
+      emit_llvm = true;
+    else if (!parse_codegen_option(argv[i])) {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
@@ -66,6 +82,8 @@ int main() {
   InitializeAllAsmPrinters();
 
   initialize_module_for_compilation();
+  CONST_EVAL = true;
+  SIMD_VARIANTS = true;
 
   if (DEBUG) {
     auto file_name = std::getenv("SOURCE_FILE_NAME");
@@ -75,8 +93,8 @@ int main() {
         "K++ Compiler", false, "", 0);
   }
 
-  set_lex_source(std::make_unique<std::fstream>("lib/core.hkl"));
-  handle_unit();
+  if (!load_prelude("lib/core.hkl", handle_unit))
+    return 1;
 
   auto str_stream = std::make_unique<std::stringstream>();
   auto &ss = *str_stream;
@@ -87,6 +105,19 @@ int main() {
     ss.clear();
   }
 
+  // Every definition is known now, so calls with constant arguments can be
+  // specialized.
+  if (!DEBUG)
+    for (auto *F : specialize_constant_calls(*TheModule))
+      optimize_function(*F);
+
+  if (DBuilder)
+    DBuilder->finalize();
+  if (emit_llvm) {
+    TheModule->print(outs(), nullptr);
+    return 0;
+  }
+
   auto file_name = "output.s";
   std::error_code EC;
   raw_fd_ostream dest(file_name, EC, sys::fs::OF_None);
@@ -103,8 +134,6 @@ int main() {
     errs() << "TheTargetMachine can't emit a file of this type";
     return 1;
   }
-  if (DBuilder)
-    DBuilder->finalize();
   pass.run(*TheModule);
   dest.flush();
 
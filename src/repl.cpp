@@ -1,13 +1,26 @@
 #include "Kaleidoscope.h"
+#include "external.h"
 #include "internal.h"
 #include "lex.h"
 #include "parser.h"
+#include "prelude.h"
+#include "tiering.h"
+#include "llvm/IR/Verifier.h"
 #include "llvm/Support/TargetSelect.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <sstream>
+#include <vector>
 
 using namespace llvm;
 
+// --time: report how long each unit took from parsing to evaluation; units
+// are then no longer overlapped with each other
+static bool TIME_UNITS = false;
+
 // read one unit of translation
 int get_unit(std::stringstream &ss) {
   char c;
@@ -28,7 +41,7 @@ int get_unit(std::stringstream &ss) {
   return 0;
 }
 
-/// top ::= definition | external | expression | ';'
+/// top ::= definition | external | constant | expression | ';'
 static void handle_unit() {
   get_next_token();
   while (true) {
@@ -39,11 +52,15 @@ static void handle_unit() {
       get_next_token();
       break;
     case tok_def:
+    case tok_memo:
       handle_definition();
       break;
     case tok_extern:
       handle_extern();
       break;
+    case tok_const:
+      handle_const();
+      break;
     default:
       handle_top_level_expression();
       break;
@@ -51,33 +68,151 @@ static void handle_unit() {
   }
 }
 
-int main() {
+// kpp --prelude: files loaded after the standard library
+static std::vector<const char *> PRELUDES;
+
+static void load_standard_library() {
+  load_prelude("lib/core.hkl", handle_unit);
+  load_prelude("lib/core.kl", handle_unit);
+  load_prelude("lib/builtin.kl", handle_unit);
+
+  for (auto *prelude : PRELUDES)
+    load_prelude(prelude, handle_unit);
+}
+
+// --precision=single: the process exports the double runtime; Kl++ code
+// calls the float one under the same names.
+static void define_single_precision_runtime() {
+  std::pair<const char *, void *> runtime[] = {
+      {"putchard", reinterpret_cast<void *>(&kl_f32_putchard)},
+      {"print", reinterpret_cast<void *>(&kl_f32_print)},
+      {"printd", reinterpret_cast<void *>(&kl_f32_printd)},
+      {"flush", reinterpret_cast<void *>(&kl_f32_flush)},
+      {"nargs", reinterpret_cast<void *>(&kl_f32_nargs)},
+      {"arg", reinterpret_cast<void *>(&kl_f32_arg)},
+      {"memostats", reinterpret_cast<void *>(&kl_f32_memostats)},
+      {"memolimit", reinterpret_cast<void *>(&kl_f32_memolimit)},
+      {"mapfile", reinterpret_cast<void *>(&kl_f32_mapfile)},
+      {"mapdata", reinterpret_cast<void *>(&kl_f32_mapdata)},
+      {"readnum", reinterpret_cast<void *>(&kl_f32_readnum)},
+      {"eof", reinterpret_cast<void *>(&kl_f32_eof)},
+      {"kl_memo_lookup", reinterpret_cast<void *>(&kl_f32_kl_memo_lookup)},
+      {"kl_memo_store", reinterpret_cast<void *>(&kl_f32_kl_memo_store)},
+      {"kl_parallel_reduce",
+       reinterpret_cast<void *>(&kl_f32_kl_parallel_reduce)},
+  };
+  for (auto [name, address] : runtime)
+    ExitOnErr(TheJIT->defineAbsolute(
+        name, ExecutorSymbolDef(ExecutorAddr::fromPtr(address),
+                                JITSymbolFlags::Exported |
+                                    JITSymbolFlags::Callable)));
+}
+
+// kpp --run: compile the whole file together with the standard library into
+// one module, optimize it, JIT it once and call `main`.
+static int run_file(const char *file_name, int argc, char **argv) {
+  auto source = std::make_unique<std::fstream>(file_name, std::ios::in);
+  if (!source->is_open()) {
+    fprintf(stderr, "Could not open file %s\n", file_name);
+    return 1;
+  }
+
+  BATCH_MODE = true;
+  load_standard_library();
+  set_lex_source(std::move(source));
+  handle_unit();
+
+  if (!TheModule->getFunction("main")) {
+    fprintf(stderr, "Error: %s does not define `main`\n", file_name);
+    return 1;
+  }
+  if (verifyModule(*TheModule, &errs()))
+    return 1;
+
+  optimize_module();
+  ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), TheTSC)));
+
+  auto main_symbol = ExitOnErr(TheJIT->lookup("main"));
+  auto fp = main_symbol.getAddress().toPtr<int (*)()>();
+
+  kl_set_args(argc, argv);
+  int result = fp();
+  kl_flush();
+  return result;
+}
+
+int main(int argc, char **argv) {
+  const char *run_file_name = nullptr;
+  bool inline_units = true;
+  int i = 1;
+  for (; i < argc && !run_file_name; ++i) {
+    if (std::strcmp(argv[i], "--time") == 0)
+      TIME_UNITS = true;
+    else if (std::strcmp(argv[i], "--print-passes") == 0)
+      PRINT_PASSES = true;
+    else if (std::strcmp(argv[i], "--no-inline") == 0)
+      inline_units = false;
+    else if (std::strcmp(argv[i], "--tiered") == 0)
+      TIERED = true;
+    else if (std::strncmp(argv[i], "--tier-entry=", 13) == 0)
+      TIER_ENTRY_THRESHOLD =
+          std::max(std::strtoull(argv[i] + 13, nullptr, 10), 1ull);
+    else if (std::strncmp(argv[i], "--tier-backedge=", 16) == 0)
+      TIER_BACKEDGE_THRESHOLD =
+          std::max(std::strtoull(argv[i] + 16, nullptr, 10), 1ull);
+    else if (std::strcmp(argv[i], "--prelude") == 0 && i + 1 < argc)
+      PRELUDES.push_back(argv[++i]);
+    else if (std::strcmp(argv[i], "--run") == 0 && i + 1 < argc)
+      run_file_name = argv[++i];
+    else if (parse_codegen_option(argv[i]))
+      continue;
+    else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  // Tier 1 recompiles hot functions as a whole; inlined copies would go stale
+  // behind the stubs.
+  JIT_INLINING = inline_units && !TIERED;
+
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
 
   TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
   initialize_modules_and_managers_for_jit();
+  if (SINGLE_PRECISION)
+    define_single_precision_runtime();
 
-  fprintf(stderr, REPL_STR);
-
-  set_lex_source(std::make_unique<std::fstream>("lib/core.hkl"));
-  handle_unit();
+  // Everything after the file name belongs to the program; the file name
+  // itself plays the part of argv[0].
+  if (run_file_name)
+    return run_file(run_file_name, argc - i + 1, argv + i - 1);
 
-  set_lex_source(std::make_unique<std::fstream>("lib/core.kl"));
-  handle_unit();
+  fprintf(stderr, REPL_STR);
 
-  set_lex_source(std::make_unique<std::fstream>("lib/builtin.kl"));
-  handle_unit();
+  if (TIERED)
+    declare_tier_builtins();
+  load_standard_library();
 
   auto str_stream = std::make_unique<std::stringstream>();
   auto &ss = *str_stream;
   set_lex_source(std::move(str_stream));
   while ((get_unit(ss)) != EOF) {
+    auto unit_start = std::chrono::steady_clock::now();
     handle_unit();
+    if (TIME_UNITS) {
+      // Evaluation is asynchronous; time the whole unit.
+      wait_for_pending_units();
+      std::chrono::duration<double, std::milli> elapsed =
+          std::chrono::steady_clock::now() - unit_start;
+      fprintf(stderr, "\r  \t[%.3f ms]\n", elapsed.count());
+    }
     ss.str("");
     ss.clear();
   }
 
+  wait_for_pending_units();
   return 0;
 }
@@ -0,0 +1,17 @@
+#!/bin/sh
+# prelude_cache.sh <kpp> <source dir>: loads a prelude cold, which writes its
+# .kpch cache, then warm, which reads it, in both precisions. Every run must
+# print the same result.
+set -e
+kpp=$1
+dir=prelude_cache
+rm -rf $dir
+mkdir $dir
+cp "$2/tests/prelude_cache.kl" $dir/
+for precision in double single; do
+  for run in cold warm; do
+    echo "twice_tan(1) + tan(0) + answer;" |
+      "$kpp" --precision=$precision --prelude $dir/prelude_cache.kl 2>&1
+  done
+done
+ls $dir